@@ -27,7 +27,7 @@ typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-ub4 hash( register ub1 *, register ub4, register ub4);
+ub4 hash( ub1 *, ub4, ub4);
 
 /*
 --------------------------------------------------------------------
@@ -0,0 +1,63 @@
+-- SQL declarations for the functions in pg_smile
+-- Load with: psql -d <database> -f sql/pg_smile.sql
+
+-- smile_infer(bayes_file, target_name, target_state, row)
+CREATE OR REPLACE FUNCTION smile_infer(text, text, text, record) RETURNS int4
+    AS 'pg_smile', 'smile_infer'
+    LANGUAGE C STRICT;
+
+-- smile_infer_batch(bayes_file, target_name, target_state, rows)
+-- e.g. SELECT smile_infer_batch('model.xdsl', 'Adoption', 'yes', array_agg(d)) FROM districts d;
+CREATE OR REPLACE FUNCTION smile_infer_batch(text, text, text, record[]) RETURNS int4[]
+    AS 'pg_smile', 'smile_infer_batch'
+    LANGUAGE C STRICT;
+
+-- Evidence signatures seen by smile_infer, sampled when smile.profile_sample_rate > 0
+-- signature holds the state id of each node, in node order (-1 = no evidence)
+CREATE TABLE IF NOT EXISTS smile_evidence_profile (
+    xdsl text NOT NULL,
+    target text NOT NULL,
+    signature int4[] NOT NULL,
+    hits int8 NOT NULL DEFAULT 0,
+    PRIMARY KEY (xdsl, target, signature)
+);
+
+-- smile_prewarm(bayes_file, target_name, count)
+-- Precomputes the count most frequent signatures for this session; returns the number computed
+CREATE OR REPLACE FUNCTION smile_prewarm(text, text, int4) RETURNS int4
+    AS 'pg_smile', 'smile_prewarm'
+    LANGUAGE C STRICT;
+
+-- smile_infer_scenarios(bayes_files, target_name, target_state, row)
+-- Scores one row against several network variants; returns one value per variant
+CREATE OR REPLACE FUNCTION smile_infer_scenarios(text[], text, text, record) RETURNS int4[]
+    AS 'pg_smile', 'smile_infer_scenarios'
+    LANGUAGE C STRICT;
+
+-- Cut points for numeric evidence columns; these override the smile_cuts property of a node in the .xdsl file
+-- State k of the node covers cuts[k] <= value < cuts[k + 1] (1-based), so a node with n states needs n - 1 cut points
+CREATE TABLE IF NOT EXISTS smile_discretization (
+    xdsl text NOT NULL,
+    node text NOT NULL,
+    cuts float8[] NOT NULL,
+    PRIMARY KEY (xdsl, node)
+);
+
+-- smile_infer_agg(bayes_file, target_name, row)
+-- Aggregate: applies the distribution of each evidence node's states over the group as likelihood
+-- evidence in one inference, and returns the probabilities of the target states
+-- e.g. SELECT region, smile_infer_agg('model.xdsl', 'Adoption', d) FROM districts d GROUP BY region;
+CREATE OR REPLACE FUNCTION smile_infer_agg_trans(internal, text, text, record) RETURNS internal
+    AS 'pg_smile', 'smile_infer_agg_trans'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION smile_infer_agg_final(internal) RETURNS float8[]
+    AS 'pg_smile', 'smile_infer_agg_final'
+    LANGUAGE C;
+
+DROP AGGREGATE IF EXISTS smile_infer_agg(text, text, record);
+CREATE AGGREGATE smile_infer_agg(text, text, record) (
+    SFUNC = smile_infer_agg_trans,
+    STYPE = internal,
+    FINALFUNC = smile_infer_agg_final
+);
@@ -6,9 +6,13 @@
  * Created on December 14, 2011, 2:46 PM
  */
 
+#ifndef SMILE_NATIVE
+
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <math.h>
 #include <time.h>
 #include <smile/smile.h>
@@ -143,6 +147,59 @@ int getStateId(const char *fname, int id, const char *state) {
     return i;
 }
 
+char* copyStateName(const char *fname, int id, int stateid, char name[]) {
+    struct net net_info;
+    DSL_idArray *outcomes;
+    
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return 0;
+    }
+    
+    outcomes = (net_info.ptr)->GetNode(id)->Definition()->GetOutcomesNames();
+    if (stateid < 0 || stateid >= outcomes->NumItems()) {
+        return 0;
+    }
+    
+    return strcpy(name, (*outcomes)[stateid]);
+}
+
+/*
+ * @brief Reads the cut points used to discretize numeric evidence for a node
+ * 
+ * @param fname Filename of an .xdsl file
+ * @param id Node id
+ * @param cuts Array to hold up to maxcuts cut points
+ * @param maxcuts Size of the cuts array
+ * @return Number of cut points (0 if the node has no CUTS_PROPERTY user property), or -1 on error
+ * 
+ */
+int getCutPoints(const char *fname, int id, double cuts[], int maxcuts) {
+    struct net net_info;
+    const char *p;
+    char *end;
+    int i, n;
+    
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return -1;
+    }
+    
+    DSL_userProperties &props = (net_info.ptr)->GetNode(id)->Info().UserProperties();
+    i = props.FindProperty(CUTS_PROPERTY);
+    if (i < 0) {
+        return 0;
+    }
+    
+    p = props.GetPropertyValue(i);
+    for (n = 0; n < maxcuts; n++) {
+        cuts[n] = strtod(p, &end);
+        if (end == p) break;
+        p = end;
+    }
+    return n;
+}
+
 void free_node(struct node n) {
     if (n.name) pfree(n.name);
     if (n.state) pfree(n.state);
@@ -158,6 +215,54 @@ void free_nodes(struct node *n, int N) {
     pfree(n);
 }
 
+/*
+ * @brief Looks up the ids of the target and evidence nodes where they are not already set
+ * 
+ * @param net The network
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param evidence An array of node structs with node names and/or ids set; can be zero
+ * @param nevidence Size of the evidence array
+ * @return status
+ * @details A nonpositive id signals that it's undefined. The ids are written back,
+ *   so on repeated calls these are defined.
+ * 
+ */
+static int resolveNodes(DSL_network *net, struct node *target, struct node evidence[], int nevidence) {
+    int all_ok;
+    int i;
+    
+    if (target->id <= 0) {
+        target->id = net->FindNode(target->name);
+        if (target->id == DSL_OUT_OF_RANGE) {
+            return SMILE_BAD_TARGET_NAME;
+        }
+    }
+    if (net->GetNode(target->id)->Definition()->GetNumberOfOutcomes() != target->count) {
+        return SMILE_TARGET_SIZE_DIFF_FROM_COUNT;
+    }
+    
+    // Even if a problem, loop over all and return to user
+    all_ok = 1;
+    for (i = 0; evidence && i < nevidence; i++) {
+        if (evidence[i].id <= 0) {
+            evidence[i].id = net->FindNode(evidence[i].name);
+            if (evidence[i].id == DSL_OUT_OF_RANGE) {
+                all_ok = 0;
+            }
+        }
+    }
+    return all_ok ? SMILE_OK : SMILE_BAD_EVIDENCE_NAME;
+}
+
+/*
+ * @brief A cached getProb result, with the key it was computed for
+ */
+struct prob_entry {
+    vector<ub1> key;    // Network id, target id and evidence state ids (see getProb)
+    vector<double> val; // Probability of each target state
+};
+
 /*
  * @brief Carries out Bayesian inference for a row of values
  * 
@@ -166,6 +271,7 @@ void free_nodes(struct node *n, int N) {
  *    This must have struct element target.count set to the number of outcomes
  * @param val Pointer to an array of size target.count to hold target probabilities (undef if error)
  * @param evidence An array of node structs with node names and/or ids set, and evidence names set or zero (null pointer); can be zero
+ *    Where the evidence name is zero, the state id is used (-1 for no evidence)
  * @param nevidence Size of the evidence array
  * @return status
  * 
@@ -174,7 +280,6 @@ int getProb(const char *fname, struct node *target, double val[], struct node ev
     DSL_network *net;
     struct net net_info;
     DSL_Dmatrix *matptr;
-    int all_ok;
     int numnodes, numoutcomes;
     int i, j, m;
     int retval = SMILE_OK;
@@ -182,10 +287,10 @@ int getProb(const char *fname, struct node *target, double val[], struct node ev
     // Hash table for storing results
     int h;
     int tot_len;
-    double prob_tot;
-    static double prob_hash[hashsize(16)][MAX_UB1];
+    static struct prob_entry *prob_hash[hashsize(16)];
+    struct prob_entry *e;
     // Assume that there are fewer than 255 possible values for each evidence node (use one negative value, -1 = 255)
-    // Also add 1 entry for the id of the network
+    // Also add EVIDENCE_OFFSET entries for the ids of the network and target
     ub1 evidence_key[MAX_NODES + EVIDENCE_OFFSET] = {0};
     
     net_info = getNetwork(fname);
@@ -195,48 +300,34 @@ int getProb(const char *fname, struct node *target, double val[], struct node ev
     net = net_info.ptr;
     
     // First, put the network id at the start of the hash key
-    evidence_key[0] = (ub1) net_info.id;
+    evidence_key[0] = (ub1) (net_info.id & 0xff);
+    evidence_key[1] = (ub1) (net_info.id >> 8);
     tot_len = EVIDENCE_OFFSET + nevidence;
     
     numnodes = net->GetNumberOfNodes();
 
-    // Get the id of the target node if not already defined
-    if (target->id <= 0) {
-        target->id = net->FindNode(target->name);
-        // Even if a problem, loop over all and return to user
-        if (target->id == DSL_OUT_OF_RANGE) {
-            return SMILE_BAD_TARGET_NAME;
-        }
+    // Get the ids of the target and evidence nodes if not already defined
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
     }
+    // Then the target id, so each target of a network has its own entries
+    evidence_key[2] = (ub1) (target->id & 0xff);
+    evidence_key[3] = (ub1) (target->id >> 8);
 
     // Clear evidence & set new evidence (if defined)
     net->ClearAllEvidence();
 
     // Set evidence, if set
     if (evidence) {
-        // Get the ids of the evidence nodes if not already defined
-        all_ok = 1;
-        for (i = 0; i < nevidence; i++) {
-            // A negative value for id signals that it's undefined
-            // This modifies the return value, so on repeated calls these are defined
-            if (evidence[i].id <= 0) {
-                evidence[i].id = net->FindNode(evidence[i].name);
-                // Even if a problem, loop over all and return to user
-                if (all_ok && evidence[i].id == DSL_OUT_OF_RANGE) {
-                    all_ok = 0;
-                }
-            }
-        }
-        if (!all_ok) {
-            return SMILE_BAD_EVIDENCE_NAME;
-        }
-
         for (i = 0; i < nevidence; i++) {
             numoutcomes = net->GetNode(evidence[i].id)->Definition()->GetNumberOfOutcomes();
             outcomes = net->GetNode(evidence[i].id)->Definition()->GetOutcomesNames();
-            // Take the string state as definitive: if null, then no evidence set
+            // Take the string state as definitive: if null, then use the state id as set
+            // by the caller (e.g. from a discretized numeric value), where -1 = no evidence set
             if (!evidence[i].state[0]) {
-                evidence[i].stateid = -1;
+                if (evidence[i].stateid >= numoutcomes) {
+                    evidence[i].stateid = -1;
+                }
             } else {
                 for (j = 0; j < numoutcomes; j++) {
                     m = strcmp(evidence[i].state, ((string) (*outcomes)[j]).c_str());
@@ -266,13 +357,12 @@ int getProb(const char *fname, struct node *target, double val[], struct node ev
     // Have we already stored this? If yes, return immediately.
     h = hash((ub1 *) evidence_key, (ub4) tot_len, (ub4) 0);
     h = (h & hashmask(16));
-    prob_tot = 0.0;
-    for (i = 0; i < target->count; i++) {
-        prob_tot += prob_hash[h][i];
-    }
-    if (prob_tot > 0.5) { // Should be equal to 1.0, so this is well away from 0.0 (initialization) and 1.0
+    e = prob_hash[h];
+    // Each slot keeps its key, so a different key that hashes to the same slot is computed and replaces it
+    if (e && (int) e->val.size() == target->count && e->key.size() == (size_t) tot_len
+            && !memcmp(&e->key[0], evidence_key, tot_len)) {
         for (i = 0; i < target->count; i++) {
-            val[i] = prob_hash[h][i];
+            val[i] = e->val[i];
         }
         return SMILE_OK;
     }
@@ -296,13 +386,133 @@ int getProb(const char *fname, struct node *target, double val[], struct node ev
     }
     
     if (retval == SMILE_OK) {
-        for (i = 0; i < target->count; i++) {
-            prob_hash[h][i] = val[i];
+        if (!e) {
+            e = prob_hash[h] = new prob_entry;
         }
+        e->key.assign(evidence_key, evidence_key + tot_len);
+        e->val.assign(val, val + target->count);
     }
     
     return retval;
 }
+/*
+ * @brief Carries out Bayesian inference with likelihood (virtual) evidence
+ * 
+ * @param fname Filename of an .xdsl file
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param val Pointer to an array of size target.count to hold target probabilities (undef if error)
+ * @param evidence An array of node structs with node names and/or ids set (states are ignored)
+ * @param likelihood For each evidence node, an array with a likelihood for each of its states, or zero for no evidence
+ * @param nevidence Size of the evidence and likelihood arrays
+ * @return status
+ * 
+ */
+int getProbLikelihood(const char *fname, struct node *target, double val[], struct node evidence[], const double *likelihood[], int nevidence) {
+    DSL_network *net;
+    struct net net_info;
+    DSL_Dmatrix *matptr;
+    int retval;
+    int i, m, numoutcomes;
+    
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    }
+    net = net_info.ptr;
+    
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
+    }
+    
+    net->ClearAllEvidence();
+    for (i = 0; i < nevidence; i++) {
+        if (likelihood[i]) {
+            numoutcomes = net->GetNode(evidence[i].id)->Definition()->GetNumberOfOutcomes();
+            vector<double> lik(likelihood[i], likelihood[i] + numoutcomes);
+            // Soft evidence is SMILE's virtual evidence: a likelihood per state (rescaled to sum to one)
+            if (net->GetNode(evidence[i].id)->Value()->SetSoftEvidence(lik) < 0) {
+                return SMILE_INVALID_VALUE;
+            }
+        }
+    }
+    net->UpdateBeliefs();
+    
+    if (!net->GetNode(target->id)->Value()->IsValueValid()) {
+        return SMILE_INVALID_VALUE;
+    }
+    m = net->GetNode(target->id)->Value()->GetSize();
+    if (m != target->count) {
+        return SMILE_TARGET_SIZE_DIFF_FROM_COUNT;
+    }
+    matptr = net->GetNode(target->id)->Value()->GetMatrix();
+    for (i = 0; i < m; i++) {
+        val[i] = matptr->Subscript(i);
+    }
+    
+    return SMILE_OK;
+}
 
+/*
+ * @brief Carries out Bayesian inference for many rows of values with the same evidence nodes
+ * 
+ * @param fname Filename of an .xdsl file
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param val Pointer to an array of size nrows * target.count to hold target probabilities
+ *    (a row is NaN if its value was invalid)
+ * @param evidence An array of node structs with node names and/or ids set (states are ignored)
+ * @param nevidence Size of the evidence array
+ * @param stateids Array of size nrows * nevidence with the state id of each evidence node in each row, or -1 if not set
+ * @param nrows Number of rows
+ * @return status
+ * 
+ */
+int getProbBatch(const char *fname, struct node *target, double val[], struct node evidence[], int nevidence, const int stateids[], int nrows) {
+    DSL_network *net;
+    struct net net_info;
+    DSL_Dmatrix *matptr;
+    int i, r, m, sid;
+    int retval = SMILE_OK;
+    
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    }
+    net = net_info.ptr;
+    
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
+    }
+    
+    for (r = 0; r < nrows; r++) {
+        net->ClearAllEvidence();
+        for (i = 0; i < nevidence; i++) {
+            sid = stateids[(size_t) r * nevidence + i];
+            if (sid >= 0) {
+                net->GetNode(evidence[i].id)->Value()->SetEvidence(sid);
+            }
+        }
+        net->UpdateBeliefs();
+        
+        if (net->GetNode(target->id)->Value()->IsValueValid()) {
+            m = net->GetNode(target->id)->Value()->GetSize();
+            if (m != target->count) {
+                return SMILE_TARGET_SIZE_DIFF_FROM_COUNT;
+            }
+            matptr = net->GetNode(target->id)->Value()->GetMatrix();
+            for (i = 0; i < m; i++) {
+                val[(size_t) r * target->count + i] = matptr->Subscript(i);
+            }
+        } else {
+            for (i = 0; i < target->count; i++) {
+                val[(size_t) r * target->count + i] = NAN;
+            }
+            retval = SMILE_INVALID_VALUE;
+        }
+    }
+    
+    return retval;
+}
 
-
+#endif /* SMILE_NATIVE */
@@ -19,7 +19,11 @@
 #define MAX_UB1 256
 #define MAX_NODES 1024
 #define NUM_TARG_NODES 2
-#define EVIDENCE_OFFSET 1
+// Bytes of the getProb cache key before the evidence: the network id and target id, two bytes each
+#define EVIDENCE_OFFSET 4
+
+// User property holding the cut points of a node, e.g. <property id="smile_cuts">0.5 1.5</property>
+#define CUTS_PROPERTY "smile_cuts"
 
 #define INFO_EXPONENT 0.5
 
@@ -42,8 +46,14 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#ifdef SMILE_STANDALONE
+// Built without PostgreSQL (e.g. the smile_score tool)
+#include <stdlib.h>
+#define pfree free
+#else
 // Use this for palloc definition
 #include "postgresql/postgres.h"
+#endif
 
 struct node {
     char name[LEN_STRING];
@@ -59,7 +69,11 @@ int getNodeNameLen(const char *fname, int id);
 char* copyNodeName(const char *fname, int id, char *name);
 int getNumOutcomes(const char *fname, int id);
 int getStateId(const char *fname, int id, const char *state);
+char* copyStateName(const char *fname, int id, int stateid, char *name);
+int getCutPoints(const char *fname, int id, double cuts[], int maxcuts);
 int getProb(const char *fname, struct node *target, double val[], struct node evidence[], int nevidence);
+int getProbLikelihood(const char *fname, struct node *target, double val[], struct node evidence[], const double *likelihood[], int nevidence);
+int getProbBatch(const char *fname, struct node *target, double val[], struct node evidence[], int nevidence, const int stateids[], int nrows);
 
 void free_node(struct node n);
 void free_nodes(struct node *n, int N);
@@ -6,6 +6,30 @@
  */
 
 #include "smile_funcs.h"
+#include "../include/bj_hash.h"
+
+/*
+ * Settings (see _PG_init):
+ *   smile.profile_sample_rate = Fraction of smile_infer calls whose evidence signature is recorded
+ */
+static double profile_sample_rate = 0.0;
+
+/*
+ * Evidence signatures recorded by this backend and not yet written (see recordProfile)
+ */
+static struct profile_entry profile_pending[PROFILE_BATCH];
+static int profile_npending = 0;
+static int profile_nhits = 0;
+
+/**
+ * @brief Registers the extension's settings when the library is loaded
+ */
+void _PG_init(void) {
+    DefineCustomRealVariable("smile.profile_sample_rate",
+                             "Fraction of smile_infer calls whose evidence is recorded in smile_evidence_profile.",
+                             NULL, &profile_sample_rate, 0.0, 0.0, 1.0,
+                             PGC_USERSET, 0, NULL, NULL, NULL);
+}
 
 /**
  * @brief A simple logging file for debugging
@@ -53,6 +77,583 @@ char *text2cstring(text *string) {
     return retval;
 }
 
+/**
+ * @brief Combines a posterior and the prior of the target into the value returned to PostgreSQL
+ * 
+ * @param value Posterior probabilities of the target states
+ * @param nulvalue Probabilities of the target states with no evidence set
+ * @param count Number of target states
+ * @param tstate Id of the target state to report
+ * @return The information class (4, 8 or 12) plus the probability class (1, 2 or 3) of tstate
+ * 
+ */
+int32 scoreValue(const double value[], const double nulvalue[], int count, int tstate) {
+    int32 retval;
+    double info, S0, S1;
+    int i;
+
+    // Calculate "information" measure
+    // In principle this should be the log odds ratio, but that has bad behavior near p = 0,
+    // and in any case is not bounded. This is a tunable function that fits a normalized version
+    // of the log odds ratio over much of its extent:
+    //    f(p) = 0.5 * (4 * p * (1-p))^INFO_EXPONENT , p =< 0.5
+    //    f(p) = 1 - f(1-p), p > 0.5
+    // Generalized to more than two states, but still test based on value[0]
+    
+    S0 = S1 = 1.0;
+    for (i = 0; i < count; i++) {
+        S0 *= count * nulvalue[i];
+        S1 *= count * value[i];
+    }
+    S0 = 0.5 * pow(S0, INFO_EXPONENT);
+    S1 = 0.5 * pow(S1, INFO_EXPONENT);
+    if (nulvalue[0] > 0.5) {
+        S0 = 1 - S0;
+    }
+    if (value[0] > 0.5) {
+        S1 = 1 - S1;
+    }
+    info = abs(S0 - S1);
+    
+    retval = 0;
+    if (info > THRESH_MODERATE) {
+        if (info > THRESH_HIGH) {
+            retval += 12;
+        } else {
+            retval += 8;
+        }
+    } else {
+        retval += 4;
+    }
+    if (value[tstate] > THRESH_MODERATE) {
+        if (value[tstate] > THRESH_HIGH) {
+            retval += 3;
+        } else {
+            retval += 2;
+        }
+    } else {
+        retval += 1;
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Gets the names and numbers of states of the nodes of a network, loading them on first use
+ * 
+ * @param xdsl_file Filename of the .xdsl file
+ * @return The nodes (kept for the life of the session, until another network takes the slot)
+ * @details Each slot keeps its filename, so a network that hashes to the same slot replaces it.
+ * 
+ */
+const struct netnodes *getNodesFor(const char *xdsl_file) {
+    static struct netnodes *nets[hashsize(10)];
+    struct netnodes *nn;
+    int i, len;
+    ub4 h;
+
+    h = hash((ub1 *) xdsl_file, (ub4) strlen(xdsl_file), (ub4) 0);
+    h = (h & hashmask(10));
+    nn = nets[h];
+    if (nn && nn->xdsl_file && !strcmp(nn->xdsl_file, xdsl_file)) {
+        return nn;
+    }
+    if (!nn) {
+        nn = nets[h] = (struct netnodes *) MemoryContextAllocZero(TopMemoryContext, sizeof(struct netnodes));
+    }
+    // Empty the slot first, so an error while filling it leaves it empty
+    if (nn->xdsl_file) pfree(nn->xdsl_file);
+    if (nn->names) pfree(nn->names);
+    if (nn->counts) pfree(nn->counts);
+    nn->xdsl_file = NULL;
+    nn->names = NULL;
+    nn->counts = NULL;
+
+    // Have to do this here because of problems passing memory locations from smile_c.cpp to here
+    nn->numnodes = getNumNodes(xdsl_file);
+    nn->names = (char (*)[LEN_STRING]) MemoryContextAlloc(TopMemoryContext, LEN_STRING * (nn->numnodes + 1));
+    nn->counts = (int *) MemoryContextAlloc(TopMemoryContext, sizeof(int) * (nn->numnodes + 1));
+    for (i = 0; i < nn->numnodes; i++) {
+        if (!(len = getNodeNameLen(xdsl_file, i))) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Could not get node name length")));
+        }
+        if (len >= LEN_STRING) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Node name length exceeds maximum of %d bytes", LEN_STRING)));
+        }
+        if (!copyNodeName(xdsl_file, i, nn->names[i])) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error getting node name")));
+        }
+        nn->counts[i] = getNumOutcomes(xdsl_file, i);
+    }
+    nn->xdsl_file = MemoryContextStrdup(TopMemoryContext, xdsl_file);
+
+    return nn;
+}
+
+/**
+ * @brief Indexes the columns of a row type by name
+ * 
+ * @param tupDesc The row type; can be zero (no columns)
+ * @param ci Set to the index, allocated in the current memory context
+ * @return void
+ * 
+ */
+void buildColIndex(TupleDesc tupDesc, struct colindex *ci) {
+    int j, natts;
+    ub4 h;
+
+    natts = tupDesc ? tupDesc->natts : 0;
+    ci->tupDesc = tupDesc;
+    // At most half full, so probes stay short
+    for (ci->bits = 1; hashsize(ci->bits) < (ub4) (2 * natts); ci->bits++);
+    ci->slots = (int *) palloc0(sizeof(int) * hashsize(ci->bits));
+    for (j = 0; j < natts; j++) {
+        h = hash((ub1 *) NameStr(tupDesc->attrs[j]->attname), (ub4) strlen(NameStr(tupDesc->attrs[j]->attname)), (ub4) 0);
+        h = (h & hashmask(ci->bits));
+        while (ci->slots[h]) {
+            h = ((h + 1) & hashmask(ci->bits));
+        }
+        ci->slots[h] = j + 1;
+    }
+}
+
+/**
+ * @brief Finds a column by name in an index built by buildColIndex
+ * 
+ * @param ci The index
+ * @param name The column name
+ * @return Index of the column in the row type, or -1 if there is none
+ * 
+ */
+int findColumn(const struct colindex *ci, const char *name) {
+    ub4 h;
+    int j;
+
+    h = hash((ub1 *) name, (ub4) strlen(name), (ub4) 0);
+    h = (h & hashmask(ci->bits));
+    while ((j = ci->slots[h] - 1) >= 0) {
+        if (!namestrcmp(&(ci->tupDesc->attrs[j]->attname), name)) {
+            return j;
+        }
+        h = ((h + 1) & hashmask(ci->bits));
+    }
+    return -1;
+}
+
+/**
+ * @brief Fills in a node struct for each node of a network and matches the nodes to the columns of a row type
+ * 
+ * @param xdsl_file Filename of the .xdsl file
+ * @param target The target node, with its name set: its id is set if a node has that name.
+ *    If target.count is set, the node must have that many states; if zero, it is set to the node's number of states
+ * @param evidence Array to hold one node struct per node, in node id order, with no evidence set
+ * @param ci Index of the columns of the row type to match node names against; can be zero
+ * @param attidx Array to hold the index in the row type of each node's column, or -1 if it has none; can be zero
+ * @return Number of nodes
+ * 
+ */
+int bindNodes(const char *xdsl_file, struct node *target, struct node evidence[], const struct colindex *ci, int attidx[]) {
+    const struct netnodes *nn;
+    int i;
+
+    nn = getNodesFor(xdsl_file);
+    for (i = 0; i < nn->numnodes; i++) {
+        strcpy(evidence[i].name, nn->names[i]);
+        evidence[i].id = i;
+        evidence[i].count = nn->counts[i];
+        evidence[i].state[0] = '\0';
+        evidence[i].stateid = -1;
+        if (attidx) {
+            attidx[i] = ci ? findColumn(ci, nn->names[i]) : -1;
+        }
+
+        // Is this the target?
+        if (!strcmp(target->name, nn->names[i])) {
+            if (!target->count) {
+                target->count = evidence[i].count;
+            } else if (evidence[i].count != target->count) {
+                ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node can only have %d possible values", target->count)));
+            }
+            target->id = i;
+        }
+    }
+
+    return nn->numnodes;
+}
+
+/**
+ * @brief Writes the evidence signatures held in memory to smile_evidence_profile
+ * 
+ * @return void
+ * @details Runs in a subtransaction, so a failure (e.g. a concurrent insert of the same signature,
+ *   or no table) drops the batch instead of aborting the caller's query. Does nothing in a
+ *   read-only transaction or on a standby: the signatures stay in memory for a later flush.
+ * 
+ */
+void flushProfile(void) {
+    Oid argtypes[4] = {TEXTOID, TEXTOID, INT4ARRAYOID, INT8OID};
+    Datum args[4];
+    Datum *sig;
+    MemoryContext oldcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    int i, k, ret;
+
+    if (!profile_npending || XactReadOnly || RecoveryInProgress()) return;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(oldcontext);
+    PG_TRY();
+    {
+        if (SPI_connect() != SPI_OK_CONNECT) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Could not connect to SPI")));
+        }
+        for (k = 0; k < profile_npending; k++) {
+            sig = (Datum *) palloc(sizeof(Datum) * (profile_pending[k].numnodes + 1));
+            for (i = 0; i < profile_pending[k].numnodes; i++) {
+                sig[i] = Int32GetDatum(profile_pending[k].signature[i]);
+            }
+            args[0] = CStringGetTextDatum(profile_pending[k].xdsl_file);
+            args[1] = CStringGetTextDatum(profile_pending[k].target_name);
+            args[2] = PointerGetDatum(construct_array(sig, profile_pending[k].numnodes, INT4OID, sizeof(int32), true, 'i'));
+            args[3] = Int64GetDatum(profile_pending[k].hits);
+            ret = SPI_execute_with_args("UPDATE smile_evidence_profile SET hits = hits + $4 "
+                                        "WHERE xdsl = $1 AND target = $2 AND signature = $3",
+                                        4, argtypes, args, NULL, false, 0);
+            if (ret == SPI_OK_UPDATE && SPI_processed == 0) {
+                SPI_execute_with_args("INSERT INTO smile_evidence_profile (xdsl, target, signature, hits) VALUES ($1, $2, $3, $4)",
+                                      4, argtypes, args, NULL, false, 0);
+            }
+            pfree(sig);
+        }
+        SPI_finish();
+
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcontext);
+        CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcontext);
+        CurrentResourceOwner = oldowner;
+        ereport(DEBUG1, (errmsg("SMILE: Could not write %d evidence signatures to smile_evidence_profile", profile_npending)));
+    }
+    PG_END_TRY();
+
+    for (k = 0; k < profile_npending; k++) {
+        pfree(profile_pending[k].xdsl_file);
+        pfree(profile_pending[k].target_name);
+        pfree(profile_pending[k].signature);
+    }
+    profile_npending = 0;
+    profile_nhits = 0;
+}
+
+/**
+ * @brief Records the evidence signature of one inference for smile_evidence_profile
+ * 
+ * @param xdsl_file Filename of the .xdsl file
+ * @param target_name Name of the target node
+ * @param evidence The evidence passed to getProb, one entry per node in node id order
+ * @param numnodes Number of nodes
+ * @return void
+ * @details The signature is the state id of each node (-1 if not set), as used for the getProb cache key.
+ *   Hits are counted in memory and written by flushProfile once PROFILE_BATCH signatures or
+ *   PROFILE_FLUSH_HITS hits are held. While the batch is full and can't be written, new signatures are dropped.
+ * 
+ */
+void recordProfile(const char *xdsl_file, const char *target_name, struct node evidence[], int numnodes) {
+    struct profile_entry *e;
+    int i, k;
+
+    for (k = 0; k < profile_npending; k++) {
+        e = &profile_pending[k];
+        if (e->numnodes != numnodes || strcmp(e->xdsl_file, xdsl_file) || strcmp(e->target_name, target_name)) continue;
+        for (i = 0; i < numnodes && e->signature[i] == evidence[i].stateid; i++);
+        if (i == numnodes) break;
+    }
+    if (k == profile_npending) {
+        if (profile_npending == PROFILE_BATCH) {
+            flushProfile();
+            if (profile_npending == PROFILE_BATCH) return;
+        }
+        k = profile_npending;
+        e = &profile_pending[k];
+        e->xdsl_file = MemoryContextStrdup(TopMemoryContext, xdsl_file);
+        e->target_name = MemoryContextStrdup(TopMemoryContext, target_name);
+        e->numnodes = numnodes;
+        e->signature = (int32 *) MemoryContextAlloc(TopMemoryContext, sizeof(int32) * (numnodes + 1));
+        for (i = 0; i < numnodes; i++) {
+            e->signature[i] = evidence[i].stateid;
+        }
+        e->hits = 0;
+        profile_npending++;
+    }
+    profile_pending[k].hits++;
+    profile_nhits++;
+
+    if (profile_npending == PROFILE_BATCH || profile_nhits >= PROFILE_FLUSH_HITS) {
+        flushProfile();
+    }
+}
+
+/**
+ * @brief Computes the posteriors of the most frequent recorded evidence signatures, filling the getProb cache
+ * 
+ * @param xdsl_file Filename of the .xdsl file
+ * @param target_name Name of the target node
+ * @param count Maximum number of signatures to compute
+ * @return Number of signatures computed
+ * @details Evidence is passed to getProb exactly as smile_infer passes it, so later calls with
+ *   the same signature are served from the cache. Signatures recorded for a different number
+ *   of nodes (an older version of the model) are skipped.
+ * 
+ */
+int prewarmCache(const char *xdsl_file, const char *target_name, int count) {
+    Oid argtypes[3] = {TEXTOID, TEXTOID, INT4OID};
+    Datum args[3];
+    Datum sig_datum, *sig;
+    double value[NUM_TARG_NODES];
+    struct node target;
+    struct node *evidence;
+    int i, k, numnodes, nsig, stateid, warmed;
+    bool isnull;
+
+    if (checkFileName(xdsl_file) != SMILE_OK) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Can't open XDSL file '%s'", xdsl_file)));
+    }
+    if (strlen(target_name) >= LEN_STRING) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node name length exceeds maximum of %d bytes", LEN_STRING)));
+    }
+    strcpy(target.name, target_name);
+    target.count = NUM_TARG_NODES;
+    target.id = -1;
+
+    evidence = (struct node *) palloc(sizeof(struct node) * (getNumNodes(xdsl_file) + 1));
+    numnodes = bindNodes(xdsl_file, &target, evidence, NULL, NULL);
+
+    // The prior is needed by every smile_infer call
+    if (getProb(xdsl_file, &target, value, 0, numnodes) != SMILE_OK) {
+        pfree(evidence);
+        return 0;
+    }
+
+    // Include this session's own signatures
+    flushProfile();
+
+    args[0] = CStringGetTextDatum(xdsl_file);
+    args[1] = CStringGetTextDatum(target_name);
+    args[2] = Int32GetDatum(count);
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Could not connect to SPI")));
+    }
+    SPI_execute_with_args("SELECT signature FROM smile_evidence_profile "
+                          "WHERE xdsl = $1 AND target = $2 ORDER BY hits DESC LIMIT $3",
+                          3, argtypes, args, NULL, true, 0);
+
+    warmed = 0;
+    for (k = 0; k < (int) SPI_processed; k++) {
+        sig_datum = SPI_getbinval(SPI_tuptable->vals[k], SPI_tuptable->tupdesc, 1, &isnull);
+        if (isnull) continue;
+        deconstruct_array(DatumGetArrayTypeP(sig_datum), INT4OID, sizeof(int32), true, 'i', &sig, NULL, &nsig);
+        if (nsig != numnodes) continue;
+
+        for (i = 0; i < numnodes; i++) {
+            evidence[i].id = i;
+            evidence[i].stateid = -1;
+            stateid = DatumGetInt32(sig[i]);
+            if (stateid < 0 || !copyStateName(xdsl_file, i, stateid, evidence[i].state)) {
+                evidence[i].state[0] = '\0';
+            }
+        }
+        if (getProb(xdsl_file, &target, value, evidence, numnodes) == SMILE_OK) {
+            warmed++;
+        }
+    }
+    SPI_finish();
+
+    pfree(evidence);
+    return warmed;
+}
+
+/**
+ * @brief Gets the discretization rules for a network, loading them on first use
+ * 
+ * @param xdsl_file Filename of the .xdsl file
+ * @return The rules (kept for the life of the session)
+ * @details Rules come from the CUTS_PROPERTY user property of each node in the .xdsl file,
+ *   overridden by rows of the smile_discretization table (if it exists). Like the network
+ *   table, this is indexed by a hash of the filename only.
+ * 
+ */
+const struct cutpoints *getCutPointsFor(const char *xdsl_file) {
+    static struct cutpoints *rules[hashsize(10)];
+    struct cutpoints *cp;
+    Oid argtypes[1] = {TEXTOID};
+    Datum args[1];
+    Datum *elems;
+    double buf[MAX_UB1];
+    char node_name[LEN_STRING];
+    char *name_tmp;
+    bool isnull;
+    int i, k, m, n, numnodes;
+    ub4 h;
+
+    h = hash((ub1 *) xdsl_file, (ub4) strlen(xdsl_file), (ub4) 0);
+    h = (h & hashmask(10));
+    if (rules[h]) {
+        return rules[h];
+    }
+
+    numnodes = getNumNodes(xdsl_file);
+    cp = (struct cutpoints *) MemoryContextAllocZero(TopMemoryContext, sizeof(struct cutpoints));
+    cp->numnodes = numnodes;
+    cp->ncuts = (int *) MemoryContextAllocZero(TopMemoryContext, sizeof(int) * (numnodes + 1));
+    cp->cuts = (double **) MemoryContextAllocZero(TopMemoryContext, sizeof(double *) * (numnodes + 1));
+
+    for (i = 0; i < numnodes; i++) {
+        n = getCutPoints(xdsl_file, i, buf, MAX_UB1);
+        if (n > 0) {
+            cp->ncuts[i] = n;
+            cp->cuts[i] = (double *) MemoryContextAlloc(TopMemoryContext, sizeof(double) * n);
+            memcpy(cp->cuts[i], buf, sizeof(double) * n);
+        }
+    }
+
+    // Rules in the config table take precedence
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Could not connect to SPI")));
+    }
+    // Only a table the unqualified name below resolves to (i.e. on the search_path)
+    SPI_execute("SELECT 1 FROM pg_catalog.pg_class WHERE relname = 'smile_discretization' AND relkind = 'r' "
+                "AND pg_catalog.pg_table_is_visible(oid)", true, 0);
+    if (SPI_processed > 0) {
+        args[0] = CStringGetTextDatum(xdsl_file);
+        SPI_execute_with_args("SELECT node, cuts FROM smile_discretization WHERE xdsl = $1",
+                              1, argtypes, args, NULL, true, 0);
+        for (k = 0; k < (int) SPI_processed; k++) {
+            name_tmp = SPI_getvalue(SPI_tuptable->vals[k], SPI_tuptable->tupdesc, 1);
+            for (i = 0; name_tmp && i < numnodes; i++) {
+                if (getNodeNameLen(xdsl_file, i) < LEN_STRING && copyNodeName(xdsl_file, i, node_name) && !strcmp(node_name, name_tmp)) {
+                    break;
+                }
+            }
+            if (!name_tmp || i == numnodes) {
+                ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Discretization rule for unknown node '%s' in '%s'", name_tmp ? name_tmp : "", xdsl_file)));
+            }
+            deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(SPI_tuptable->vals[k], SPI_tuptable->tupdesc, 2, &isnull)),
+                              FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd', &elems, NULL, &n);
+            if (cp->cuts[i]) pfree(cp->cuts[i]);
+            cp->ncuts[i] = n;
+            cp->cuts[i] = (double *) MemoryContextAlloc(TopMemoryContext, sizeof(double) * (n + 1));
+            for (m = 0; m < n; m++) {
+                cp->cuts[i][m] = DatumGetFloat8(elems[m]);
+            }
+        }
+    }
+    SPI_finish();
+
+    // Check the rules against the network
+    for (i = 0; i < numnodes; i++) {
+        if (!cp->ncuts[i]) continue;
+        if (cp->ncuts[i] + 1 != getNumOutcomes(xdsl_file, i)) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Node %d in '%s' has %d cut points but %d states", i, xdsl_file, cp->ncuts[i], getNumOutcomes(xdsl_file, i))));
+        }
+        for (k = 1; k < cp->ncuts[i]; k++) {
+            if (!(cp->cuts[i][k - 1] < cp->cuts[i][k])) {
+                ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Cut points of node %d in '%s' are not ascending", i, xdsl_file)));
+            }
+        }
+    }
+
+    rules[h] = cp;
+    return cp;
+}
+
+/**
+ * @brief Converts a column value to a double if the column is numeric
+ * 
+ * @param value The column value (not null)
+ * @param typid Type of the column
+ * @param out Set to the value
+ * @param integral Set to whether the type is an integer type
+ * @return true if the column is numeric, false otherwise (nothing is set)
+ * 
+ */
+bool numericDatum(Datum value, Oid typid, double *out, bool *integral) {
+    switch (typid) {
+        case INT2OID:
+            *out = DatumGetInt16(value);
+            *integral = true;
+            return true;
+        case INT4OID:
+            *out = DatumGetInt32(value);
+            *integral = true;
+            return true;
+        case INT8OID:
+            *out = (double) DatumGetInt64(value);
+            *integral = true;
+            return true;
+        case FLOAT4OID:
+            *out = DatumGetFloat4(value);
+            *integral = false;
+            return true;
+        case FLOAT8OID:
+            *out = DatumGetFloat8(value);
+            *integral = false;
+            return true;
+        case NUMERICOID:
+            *out = DatumGetFloat8(DirectFunctionCall1(numeric_float8, value));
+            *integral = false;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Maps a numeric value to a state id using the cut points of a node
+ * 
+ * @param cp Rules for the network
+ * @param n The node (id, name and count set)
+ * @param value The numeric value
+ * @param integral Whether the value came from an integer column
+ * @return State id, or -1 for no evidence (NaN, or an integer out of range)
+ * @details With cut points c[0] < ... < c[m-1], state k covers c[k-1] <= value < c[k].
+ *   A node without cut points takes an integer value as the state id itself.
+ * 
+ */
+int discretize(const struct cutpoints *cp, const struct node *n, double value, bool integral) {
+    const double *cuts;
+    int lo, hi, mid;
+
+    if (isnan(value)) {
+        return -1;
+    }
+    if (n->id >= cp->numnodes || !cp->ncuts[n->id]) {
+        if (!integral) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Numeric evidence for node '%s', which has no discretization rule", n->name)));
+        }
+        return (value >= 0 && value < n->count) ? (int) value : -1;
+    }
+
+    // Number of cut points <= value
+    cuts = cp->cuts[n->id];
+    lo = 0;
+    hi = cp->ncuts[n->id];
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cuts[mid] <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /**
  * @brief Carries out Bayesian inference for a row of values
  * 
@@ -61,7 +662,7 @@ char *text2cstring(text *string) {
  *   bayes_file (text) = Filename of the .xdsl file;
  *   target_name (text) = Name of the node to calculate;
  *   target_state (text) = Label for the state to return. If INFO_STRING returns the info statistic
- *   row = A PostgreSQL row with node names and values (either text or int);
+ *   row = A PostgreSQL row with node names and values (text or numeric);
  * @return Datum Calculated (multiple) values of specified node as a row
  * @details Runs the SMILE Bayesian inference engine on multiple rows and returns result for one node
  * @todo Assumes a fixed number of states for the target
@@ -69,19 +670,22 @@ char *text2cstring(text *string) {
 Datum smile_infer(FunctionCallInfo fcinfo) {
     double value[NUM_TARG_NODES], nulvalue[NUM_TARG_NODES];
     int32 retval;
-    double info, S0, S1;
-    int i, j, retcode1, retcode2, numnodes, len, tstate;
+    int i, j, retcode1, retcode2, numnodes, tstate;
     struct node target;
     struct node evidence[MAX_NODES];
+    int attidx[MAX_NODES];
+    const struct cutpoints *cp;
+    double numval;
+    bool integral;
     char *name_tmp, *target_name, *xdsl_file, *target_state;
     char log_msg[1024];
     HeapTupleHeader evidence_tuple;
     Datum tmp_datum;
-    AttrNumber attrno;
     bool isnull;
     Oid tupType;
     int32 tupTypmod;
     TupleDesc tupDesc;
+    struct colindex ci;
 
     xdsl_file = text2cstring(PG_GETARG_TEXT_P(0));
     target_name = text2cstring(PG_GETARG_TEXT_P(1));
@@ -106,42 +710,19 @@ Datum smile_infer(FunctionCallInfo fcinfo) {
     tupTypmod = HeapTupleHeaderGetTypMod(evidence_tuple);
     tupDesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
 
-    // Have to do this here because of problems passing memory locations from smile_c.cpp to here
-    numnodes = getNumNodes(xdsl_file);
+    cp = getCutPointsFor(xdsl_file);
+
+    buildColIndex(tupDesc, &ci);
+    numnodes = bindNodes(xdsl_file, &target, evidence, &ci, attidx);
     for (i = 0; i < numnodes; i++) {
-        evidence[i].id = i;
-        evidence[i].count = getNumOutcomes(xdsl_file, i);
-        
-        if (!(len = getNodeNameLen(xdsl_file, i))) {
-            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Could not get node name length")));
-        }
-        if (len > LEN_STRING) {
-            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Node name length exceeds maximum of %d bytes", LEN_STRING)));
-        }
-        if (!copyNodeName(xdsl_file, i, evidence[i].name)) {
-            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error getting node name")));
-        }
-        
-        // Is this the target?
-        if (!strcmp(target.name, evidence[i].name)) {
-            if (evidence[i].count != NUM_TARG_NODES) {
-                ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node can only have two possible values")));
-            }
-            target.id = i;
-        }
-        
-        evidence[i].state[0] = '\0';
-        attrno = InvalidAttrNumber;
-        for (j = 0; j < tupDesc->natts; j++) {
-            if (!namestrcmp(&(tupDesc->attrs[j]->attname), evidence[i].name)) {
-                attrno = tupDesc->attrs[j]->attnum;
-                break;
-            }
-        }
-        if (attrno != InvalidAttrNumber) {
-            tmp_datum = GetAttributeByNum(evidence_tuple, attrno, &isnull);
-            // If the value is null then tmp_datum = 0
-            if (tmp_datum && !isnull) {
+        j = attidx[i];
+        if (j >= 0) {
+            // If the value is null then tmp_datum = 0 and the node gets no evidence
+            tmp_datum = GetAttributeByNum(evidence_tuple, tupDesc->attrs[j]->attnum, &isnull);
+            // Numeric columns map straight to a state id, skipping the state name
+            if (!isnull && numericDatum(tmp_datum, tupDesc->attrs[j]->atttypid, &numval, &integral)) {
+                evidence[i].stateid = discretize(cp, &evidence[i], numval, integral);
+            } else if (tmp_datum && !isnull) {
                 name_tmp = text2cstring(DatumGetTextP(tmp_datum));
                 if (name_tmp && strlen(name_tmp) < LEN_STRING) {
                     strcpy(evidence[i].state, name_tmp);
@@ -151,7 +732,6 @@ Datum smile_infer(FunctionCallInfo fcinfo) {
                 if (name_tmp) pfree(name_tmp);
             }
         }
-        evidence[i].stateid = -1;
     }
 
     // Calculate the result node
@@ -166,54 +746,537 @@ Datum smile_infer(FunctionCallInfo fcinfo) {
     if (retcode2 != SMILE_OK) {
         ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d", retcode2)));
     }
-    // Calculate "information" measure
-    // In principle this should be the log odds ratio, but that has bad behavior near p = 0,
-    // and in any case is not bounded. This is a tunable function that fits a normalized version
-    // of the log odds ratio over much of its extent:
-    //    f(p) = 0.5 * (4 * p * (1-p))^INFO_EXPONENT , p =< 0.5
-    //    f(p) = 1 - f(1-p), p > 0.5
-    // Generalized to more than two states, but still test based on value[0]
+    retval = scoreValue(value, nulvalue, target.count, tstate);
+
+    if (profile_sample_rate > 0.0 && (double) random() < profile_sample_rate * (double) MAX_RANDOM_VALUE) {
+        recordProfile(xdsl_file, target.name, evidence, numnodes);
+    }
+
+    // Clean up
     
-    S0 = S1 = 1.0;
-    for (i = 0; i < target.count; i++) {
-        S0 *= target.count * nulvalue[i];
-        S1 *= target.count * value[i];
+    if (target_state) pfree(target_state);
+    if (xdsl_file) pfree(xdsl_file);
+    
+    PG_RETURN_INT32(retval);
+}
+
+
+/**
+ * @brief Carries out Bayesian inference for an array of rows
+ * 
+ * @param fcinfo
+ *   A collection of arguments:
+ *   bayes_file (text) = Filename of the .xdsl file;
+ *   target_name (text) = Name of the node to calculate;
+ *   target_state (text) = Label for the state to return;
+ *   rows = An array of PostgreSQL rows, all of the same type, with node names and values (text or numeric);
+ * @return Datum An int array with the value smile_infer would return for each row (null where the evidence is impossible)
+ * @details Columns are matched to node names once for the whole array, and all rows are
+ *   evaluated together by getProbBatch
+ */
+Datum smile_infer_batch(FunctionCallInfo fcinfo) {
+    double nulvalue[NUM_TARG_NODES];
+    double *values;
+    int i, j, c, r, retcode, numnodes, nev, nrows, tstate, lbound;
+    int *stateids;
+    struct node target;
+    struct node evidence[MAX_NODES];
+    int attidx[MAX_NODES];
+    AttrNumber attrnos[MAX_NODES];
+    Oid atttypids[MAX_NODES];
+    const struct cutpoints *cp;
+    double numval;
+    bool integral;
+    char *name_tmp, *target_name, *xdsl_file, *target_state;
+    ArrayType *rows;
+    Oid elemtype;
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    Datum *elems, *results, tmp_datum;
+    bool *elemnulls, *resultnulls, isnull;
+    HeapTupleHeader evidence_tuple;
+    Oid tupType = InvalidOid;
+    int32 tupTypmod = -1;
+    TupleDesc tupDesc;
+    struct colindex ci;
+
+    xdsl_file = text2cstring(PG_GETARG_TEXT_P(0));
+    target_name = text2cstring(PG_GETARG_TEXT_P(1));
+    target_state = text2cstring(PG_GETARG_TEXT_P(2));
+    rows = PG_GETARG_ARRAYTYPE_P(3);
+
+    if (target_name && strlen(target_name) < LEN_STRING) {
+        strcpy(target.name, target_name);
+    } else {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node name length exceeds maximum of %d bytes", LEN_STRING)));
     }
-    S0 = 0.5 * pow(S0, INFO_EXPONENT);
-    S1 = 0.5 * pow(S1, INFO_EXPONENT);
-    if (nulvalue[0] > 0.5) {
-        S0 = 1 - S0;
+    if (target_name) pfree(target_name);
+    target.count = NUM_TARG_NODES;
+    target.id = -1;
+
+    retcode = checkFileName(xdsl_file);
+    if (retcode != SMILE_OK) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Can't open XDSL file '%s'", xdsl_file)));
     }
-    if (value[0] > 0.5) {
-        S1 = 1 - S1;
+
+    elemtype = ARR_ELEMTYPE(rows);
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+    deconstruct_array(rows, elemtype, typlen, typbyval, typalign, &elems, &elemnulls, &nrows);
+
+    // Take the row type from the first row, as smile_infer does, so anonymous records work too
+    tupDesc = NULL;
+    for (r = 0; r < nrows; r++) {
+        if (elemnulls[r]) continue;
+        evidence_tuple = DatumGetHeapTupleHeader(elems[r]);
+        if (!tupDesc) {
+            tupType = HeapTupleHeaderGetTypeId(evidence_tuple);
+            tupTypmod = HeapTupleHeaderGetTypMod(evidence_tuple);
+            tupDesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
+        } else if (HeapTupleHeaderGetTypeId(evidence_tuple) != tupType || HeapTupleHeaderGetTypMod(evidence_tuple) != tupTypmod) {
+            ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH), errmsg("SMILE: All rows passed to smile_infer_batch must have the same type")));
+        }
     }
-    info = abs(S0 - S1);
-    
-    retval = 0;
-    if (info > THRESH_MODERATE) {
-        if (info > THRESH_HIGH) {
-            retval += 12;
-        } else {
-            retval += 8;
+
+    // Match nodes to columns once: only nodes with a column are evidence, packed in place
+    buildColIndex(tupDesc, &ci);
+    numnodes = bindNodes(xdsl_file, &target, evidence, &ci, attidx);
+    nev = 0;
+    for (i = 0; i < numnodes; i++) {
+        if ((j = attidx[i]) < 0) continue;
+        if (nev != i) {
+            evidence[nev] = evidence[i];
         }
-    } else {
-        retval += 4;
+        attrnos[nev] = tupDesc->attrs[j]->attnum;
+        atttypids[nev] = tupDesc->attrs[j]->atttypid;
+        nev++;
     }
-    if (value[tstate] > THRESH_MODERATE) {
-        if (value[tstate] > THRESH_HIGH) {
-            retval += 3;
-        } else {
-            retval += 2;
+
+    // Decode the state of each evidence node in each row
+    cp = getCutPointsFor(xdsl_file);
+    stateids = (int *) palloc(sizeof(int) * (nrows * nev + 1));
+    for (r = 0; r < nrows; r++) {
+        evidence_tuple = elemnulls[r] ? NULL : DatumGetHeapTupleHeader(elems[r]);
+        for (c = 0; c < nev; c++) {
+            stateids[r * nev + c] = -1;
+            if (!evidence_tuple) continue;
+            tmp_datum = GetAttributeByNum(evidence_tuple, attrnos[c], &isnull);
+            if (!isnull && numericDatum(tmp_datum, atttypids[c], &numval, &integral)) {
+                stateids[r * nev + c] = discretize(cp, &evidence[c], numval, integral);
+            } else if (tmp_datum && !isnull) {
+                name_tmp = text2cstring(DatumGetTextP(tmp_datum));
+                stateids[r * nev + c] = getStateId(xdsl_file, evidence[c].id, name_tmp);
+                if (stateids[r * nev + c] >= evidence[c].count) {
+                    stateids[r * nev + c] = -1;
+                }
+                pfree(name_tmp);
+            }
         }
-    } else {
-        retval += 1;
+    }
+
+    values = (double *) palloc(sizeof(double) * (nrows * target.count + 1));
+    retcode = getProbBatch(xdsl_file, &target, values, evidence, nev, stateids, nrows);
+    if (retcode != SMILE_OK && retcode != SMILE_INVALID_VALUE) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d", retcode)));
+    }
+    tstate = getStateId(xdsl_file, target.id, target_state);
+
+    // Calculate result node with no evidence, to calculate "info" value
+    retcode = getProb(xdsl_file, &target, nulvalue, 0, numnodes);
+    if (retcode != SMILE_OK) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d", retcode)));
+    }
+
+    results = (Datum *) palloc(sizeof(Datum) * (nrows + 1));
+    resultnulls = (bool *) palloc(sizeof(bool) * (nrows + 1));
+    for (r = 0; r < nrows; r++) {
+        resultnulls[r] = isnan(values[r * target.count]);
+        results[r] = resultnulls[r] ? (Datum) 0 : Int32GetDatum(scoreValue(values + r * target.count, nulvalue, target.count, tstate));
     }
 
     // Clean up
-    
+
+    pfree(stateids);
+    pfree(values);
     if (target_state) pfree(target_state);
     if (xdsl_file) pfree(xdsl_file);
-    
-    PG_RETURN_INT32(retval);
+
+    lbound = 1;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(results, resultnulls, 1, &nrows, &lbound, INT4OID, sizeof(int32), true, 'i'));
+}
+
+/**
+ * @brief Precomputes the posteriors of the most frequent recorded evidence signatures
+ * 
+ * @param fcinfo
+ *   A collection of arguments:
+ *   bayes_file (text) = Filename of the .xdsl file;
+ *   target_name (text) = Name of the node to calculate;
+ *   count (int) = Maximum number of signatures to compute;
+ * @return Datum Number of signatures computed
+ * @details Signatures are read from smile_evidence_profile, which is filled when smile.profile_sample_rate is set.
+ *   The cache is per session, so this warms the calling session only.
+ */
+Datum smile_prewarm(FunctionCallInfo fcinfo) {
+    char *xdsl_file, *target_name;
+    int32 count, warmed;
+
+    xdsl_file = text2cstring(PG_GETARG_TEXT_P(0));
+    target_name = text2cstring(PG_GETARG_TEXT_P(1));
+    count = PG_GETARG_INT32(2);
+
+    warmed = prewarmCache(xdsl_file, target_name, count);
+
+    pfree(target_name);
+    pfree(xdsl_file);
+
+    PG_RETURN_INT32(warmed);
+}
+
+/**
+ * @brief Carries out Bayesian inference for one row of values against several networks
+ * 
+ * @param fcinfo
+ *   A collection of arguments:
+ *   bayes_files (text[]) = Filenames of the .xdsl files, one per scenario;
+ *   target_name (text) = Name of the node to calculate;
+ *   target_state (text) = Label for the state to return;
+ *   row = A PostgreSQL row with node names and values (text or numeric);
+ * @return Datum An int array with the value smile_infer would return for each scenario (null for a null filename)
+ * @details The columns are indexed by name once for all scenarios, and each column is decoded
+ *   at most once, so a node shared by several networks resolves to the same column whatever its position
+ */
+Datum smile_infer_scenarios(FunctionCallInfo fcinfo) {
+    double value[NUM_TARG_NODES], nulvalue[NUM_TARG_NODES];
+    int i, j, s, retcode, numnodes, nscen, tstate, lbound;
+    struct node target;
+    struct node evidence[MAX_NODES];
+    int attidx[MAX_NODES];
+    char *target_name, *xdsl_file, *target_state;
+    char **colvalues;
+    double *colnumeric;
+    bool *coldecoded, *colisnumeric, *colintegral;
+    const struct cutpoints *cp;
+    ArrayType *scenarios;
+    Datum *scen_elems, *results, tmp_datum;
+    bool *scen_nulls, *resultnulls, isnull;
+    HeapTupleHeader evidence_tuple;
+    Oid tupType;
+    int32 tupTypmod;
+    TupleDesc tupDesc;
+    struct colindex ci;
+
+    scenarios = PG_GETARG_ARRAYTYPE_P(0);
+    target_name = text2cstring(PG_GETARG_TEXT_P(1));
+    target_state = text2cstring(PG_GETARG_TEXT_P(2));
+    evidence_tuple = PG_GETARG_HEAPTUPLEHEADER(3);
+
+    if (!target_name || strlen(target_name) >= LEN_STRING) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node name length exceeds maximum of %d bytes", LEN_STRING)));
+    }
+
+    deconstruct_array(scenarios, TEXTOID, -1, false, 'i', &scen_elems, &scen_nulls, &nscen);
+
+    tupType = HeapTupleHeaderGetTypeId(evidence_tuple);
+    tupTypmod = HeapTupleHeaderGetTypMod(evidence_tuple);
+    tupDesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
+
+    // Column values are decoded on first use and shared by all scenarios
+    colvalues = (char **) palloc0(sizeof(char *) * (tupDesc->natts + 1));
+    colnumeric = (double *) palloc0(sizeof(double) * (tupDesc->natts + 1));
+    coldecoded = (bool *) palloc0(sizeof(bool) * (tupDesc->natts + 1));
+    colisnumeric = (bool *) palloc0(sizeof(bool) * (tupDesc->natts + 1));
+    colintegral = (bool *) palloc0(sizeof(bool) * (tupDesc->natts + 1));
+
+    results = (Datum *) palloc(sizeof(Datum) * (nscen + 1));
+    resultnulls = (bool *) palloc(sizeof(bool) * (nscen + 1));
+
+    buildColIndex(tupDesc, &ci);
+    for (s = 0; s < nscen; s++) {
+        resultnulls[s] = scen_nulls[s];
+        results[s] = (Datum) 0;
+        if (scen_nulls[s]) continue;
+
+        xdsl_file = text2cstring(DatumGetTextP(scen_elems[s]));
+        if (checkFileName(xdsl_file) != SMILE_OK) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Can't open XDSL file '%s'", xdsl_file)));
+        }
+        strcpy(target.name, target_name);
+        target.count = NUM_TARG_NODES;
+        target.id = -1;
+
+        cp = getCutPointsFor(xdsl_file);
+
+        numnodes = bindNodes(xdsl_file, &target, evidence, &ci, attidx);
+        for (i = 0; i < numnodes; i++) {
+            j = attidx[i];
+            if (j >= 0) {
+                if (!coldecoded[j]) {
+                    coldecoded[j] = true;
+                    // If the value is null then tmp_datum = 0 and the node gets no evidence
+                    tmp_datum = GetAttributeByNum(evidence_tuple, tupDesc->attrs[j]->attnum, &isnull);
+                    if (!isnull && numericDatum(tmp_datum, tupDesc->attrs[j]->atttypid, &colnumeric[j], &colintegral[j])) {
+                        colisnumeric[j] = true;
+                    } else if (tmp_datum && !isnull) {
+                        colvalues[j] = text2cstring(DatumGetTextP(tmp_datum));
+                    }
+                }
+                if (colisnumeric[j]) {
+                    // Cut points differ between scenarios, so discretize per scenario
+                    evidence[i].stateid = discretize(cp, &evidence[i], colnumeric[j], colintegral[j]);
+                } else if (colvalues[j]) {
+                    if (strlen(colvalues[j]) < LEN_STRING) {
+                        strcpy(evidence[i].state, colvalues[j]);
+                    } else {
+                        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: State of evidence node '%s' exceeds maximum length of %d bytes", evidence[i].name, LEN_STRING)));
+                    }
+                }
+            }
+        }
+
+        // Calculate the result node
+        retcode = getProb(xdsl_file, &target, value, evidence, numnodes);
+        if (retcode != SMILE_OK) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d in '%s'", retcode, xdsl_file)));
+        }
+        tstate = getStateId(xdsl_file, target.id, target_state);
+
+        // Calculate result node with no evidence, to calculate "info" value
+        retcode = getProb(xdsl_file, &target, nulvalue, 0, numnodes);
+        if (retcode != SMILE_OK) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d in '%s'", retcode, xdsl_file)));
+        }
+
+        results[s] = Int32GetDatum(scoreValue(value, nulvalue, target.count, tstate));
+
+        if (profile_sample_rate > 0.0 && (double) random() < profile_sample_rate * (double) MAX_RANDOM_VALUE) {
+            recordProfile(xdsl_file, target.name, evidence, numnodes);
+        }
+
+        pfree(xdsl_file);
+    }
+
+    // Clean up
+
+    for (j = 0; j < tupDesc->natts; j++) {
+        if (colvalues[j]) pfree(colvalues[j]);
+    }
+    pfree(colvalues);
+    pfree(colnumeric);
+    pfree(coldecoded);
+    pfree(colisnumeric);
+    pfree(colintegral);
+    pfree(target_name);
+    pfree(target_state);
+
+    lbound = 1;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(results, resultnulls, 1, &nscen, &lbound, INT4OID, sizeof(int32), true, 'i'));
 }
 
+/**
+ * @brief Transition function of smile_infer_agg: counts the states of each evidence node
+ * 
+ * @param fcinfo
+ *   A collection of arguments:
+ *   state (internal) = The aggregate state, null on the first row;
+ *   bayes_file (text) = Filename of the .xdsl file;
+ *   target_name (text) = Name of the node to calculate;
+ *   row = A PostgreSQL row with node names and values (text or numeric);
+ * @return Datum The aggregate state
+ * @details Columns are matched to nodes on the first row; all rows must have the same type.
+ */
+Datum smile_infer_agg_trans(FunctionCallInfo fcinfo) {
+    MemoryContext aggcontext, oldcontext;
+    struct aggstate *st;
+    HeapTupleHeader evidence_tuple;
+    TupleDesc tupDesc;
+    struct colindex ci;
+    Datum tmp_datum;
+    bool isnull, integral;
+    double numval;
+    char *name_tmp, *target_name;
+    int *attidx;
+    int i, j, sid, numnodes;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: smile_infer_agg_trans called in non-aggregate context")));
+    }
+    st = PG_ARGISNULL(0) ? NULL : (struct aggstate *) PG_GETARG_POINTER(0);
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) {
+        if (st) PG_RETURN_POINTER(st);
+        PG_RETURN_NULL();
+    }
+    evidence_tuple = PG_GETARG_HEAPTUPLEHEADER(3);
+
+    if (!st) {
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+
+        st = (struct aggstate *) palloc0(sizeof(struct aggstate));
+        st->xdsl_file = text2cstring(PG_GETARG_TEXT_P(1));
+        target_name = text2cstring(PG_GETARG_TEXT_P(2));
+        if (strlen(target_name) >= LEN_STRING) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node name length exceeds maximum of %d bytes", LEN_STRING)));
+        }
+        strcpy(st->target.name, target_name);
+        pfree(target_name);
+        st->target.id = -1;
+
+        if (checkFileName(st->xdsl_file) != SMILE_OK) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Can't open XDSL file '%s'", st->xdsl_file)));
+        }
+        st->cp = getCutPointsFor(st->xdsl_file);
+        tupDesc = lookup_rowtype_tupdesc_copy(HeapTupleHeaderGetTypeId(evidence_tuple), HeapTupleHeaderGetTypMod(evidence_tuple));
+
+        numnodes = getNumNodes(st->xdsl_file);
+        st->evidence = (struct node *) palloc0(sizeof(struct node) * (numnodes + 1));
+        st->attrnos = (AttrNumber *) palloc0(sizeof(AttrNumber) * (numnodes + 1));
+        st->atttypids = (Oid *) palloc0(sizeof(Oid) * (numnodes + 1));
+        st->offsets = (int *) palloc0(sizeof(int) * (numnodes + 1));
+        st->nobs = (double *) palloc0(sizeof(double) * (numnodes + 1));
+        attidx = (int *) palloc(sizeof(int) * (numnodes + 1));
+        // Any number of target states
+        st->target.count = 0;
+        buildColIndex(tupDesc, &ci);
+        st->numnodes = bindNodes(st->xdsl_file, &st->target, st->evidence, &ci, attidx);
+        st->nstates = 0;
+        for (i = 0; i < st->numnodes; i++) {
+            st->offsets[i] = st->nstates;
+            st->nstates += st->evidence[i].count;
+
+            st->attrnos[i] = InvalidAttrNumber;
+            if ((j = attidx[i]) >= 0) {
+                st->attrnos[i] = tupDesc->attrs[j]->attnum;
+                st->atttypids[i] = tupDesc->attrs[j]->atttypid;
+            }
+        }
+        pfree(attidx);
+        pfree(ci.slots);
+        if (st->target.id < 0) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: No target node '%s' in '%s'", st->target.name, st->xdsl_file)));
+        }
+        if (st->target.count > MAX_UB1) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Target node has more than %d states", MAX_UB1)));
+        }
+        st->counts = (double *) palloc0(sizeof(double) * (st->nstates + 1));
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    for (i = 0; i < st->numnodes; i++) {
+        if (st->attrnos[i] == InvalidAttrNumber) continue;
+        tmp_datum = GetAttributeByNum(evidence_tuple, st->attrnos[i], &isnull);
+        if (isnull) continue;
+        if (numericDatum(tmp_datum, st->atttypids[i], &numval, &integral)) {
+            sid = discretize(st->cp, &st->evidence[i], numval, integral);
+        } else {
+            name_tmp = text2cstring(DatumGetTextP(tmp_datum));
+            sid = getStateId(st->xdsl_file, i, name_tmp);
+            pfree(name_tmp);
+        }
+        if (sid >= 0 && sid < st->evidence[i].count) {
+            st->counts[st->offsets[i] + sid] += 1.0;
+            st->nobs[i] += 1.0;
+        }
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+/**
+ * @brief Final function of smile_infer_agg: one inference with the state distributions as likelihood evidence
+ * 
+ * @param fcinfo
+ *   A collection of arguments:
+ *   state (internal) = The aggregate state;
+ * @return Datum The probabilities of the target states as a float8 array (null if no rows or impossible evidence)
+ * @details Each distribution is quantized to AGG_LEVELS steps before inference; the quantized
+ *   distributions are the key into a cache of results, so groups with similar compositions share
+ *   one propagation. Each slot keeps its key, and a group whose key collides with it replaces the slot.
+ */
+Datum smile_infer_agg_final(FunctionCallInfo fcinfo) {
+    static struct aggcache_entry *agg_cache[hashsize(AGG_CACHE_BITS)];
+    struct aggcache_entry *e;
+    struct aggstate *st;
+    const double **likelihood;
+    double *lik;
+    double value[MAX_UB1];
+    Datum *results;
+    ub1 *key;
+    ub4 h;
+    int i, s, q, retcode;
+
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    st = (struct aggstate *) PG_GETARG_POINTER(0);
+
+    // Quantize each observed node's distribution; unobserved nodes have no evidence
+    key = (ub1 *) palloc(st->nstates + 1);
+    lik = (double *) palloc(sizeof(double) * (st->nstates + 1));
+    likelihood = (const double **) palloc(sizeof(double *) * (st->numnodes + 1));
+    for (i = 0; i < st->numnodes; i++) {
+        likelihood[i] = st->nobs[i] > 0.0 ? lik + st->offsets[i] : NULL;
+        for (s = 0; s < st->evidence[i].count; s++) {
+            if (st->nobs[i] > 0.0) {
+                q = (int) floor(AGG_LEVELS * st->counts[st->offsets[i] + s] / st->nobs[i] + 0.5);
+                // Keep every observed state possible
+                if (q == 0 && st->counts[st->offsets[i] + s] > 0.0) q = 1;
+            } else {
+                q = AGG_LEVELS + 1;
+            }
+            key[st->offsets[i] + s] = (ub1) q;
+            lik[st->offsets[i] + s] = (double) q / AGG_LEVELS;
+        }
+    }
+
+    h = hash((ub1 *) st->xdsl_file, (ub4) strlen(st->xdsl_file), (ub4) 0);
+    h = hash((ub1 *) st->target.name, (ub4) strlen(st->target.name), h);
+    h = hash(key, (ub4) st->nstates, h);
+    h = (h & hashmask(AGG_CACHE_BITS));
+
+    // Have we already stored this? If yes, use it.
+    e = agg_cache[h];
+    if (e && e->nstates == st->nstates && e->count == st->target.count && !memcmp(e->key, key, st->nstates)
+            && !strcmp(e->xdsl_file, st->xdsl_file) && !strcmp(e->target_name, st->target.name)) {
+        for (s = 0; s < st->target.count; s++) {
+            value[s] = e->value[s];
+        }
+    } else {
+        retcode = getProbLikelihood(st->xdsl_file, &st->target, value, st->evidence, likelihood, st->numnodes);
+        if (retcode == SMILE_INVALID_VALUE) {
+            PG_RETURN_NULL();
+        }
+        if (retcode != SMILE_OK) {
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SMILE: Error code %d", retcode)));
+        }
+        if (e) {
+            pfree(e->xdsl_file);
+            pfree(e->target_name);
+            pfree(e->key);
+            pfree(e->value);
+        } else {
+            e = agg_cache[h] = (struct aggcache_entry *) MemoryContextAlloc(TopMemoryContext, sizeof(struct aggcache_entry));
+        }
+        e->xdsl_file = MemoryContextStrdup(TopMemoryContext, st->xdsl_file);
+        e->target_name = MemoryContextStrdup(TopMemoryContext, st->target.name);
+        e->nstates = st->nstates;
+        e->key = (uint8 *) MemoryContextAlloc(TopMemoryContext, st->nstates + 1);
+        memcpy(e->key, key, st->nstates);
+        e->count = st->target.count;
+        e->value = (double *) MemoryContextAlloc(TopMemoryContext, sizeof(double) * st->target.count);
+        for (s = 0; s < st->target.count; s++) {
+            e->value[s] = value[s];
+        }
+    }
+
+    results = (Datum *) palloc(sizeof(Datum) * st->target.count);
+    for (s = 0; s < st->target.count; s++) {
+        results[s] = Float8GetDatum(value[s]);
+    }
+
+    pfree(key);
+    pfree(lik);
+    pfree(likelihood);
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(results, st->target.count, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd'));
+}
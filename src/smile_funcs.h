@@ -14,6 +14,16 @@ extern "C" {
 #include "postgresql/9.1/server/utils/typcache.h"
 #include "postgresql/9.1/server/access/attnum.h"
 #include "postgresql/9.1/server/utils/builtins.h"
+#include "postgresql/9.1/server/utils/array.h"
+#include "postgresql/9.1/server/utils/lsyscache.h"
+#include "postgresql/9.1/server/catalog/pg_type.h"
+#include "postgresql/9.1/server/executor/spi.h"
+#include "postgresql/9.1/server/utils/guc.h"
+#include "postgresql/9.1/server/utils/memutils.h"
+#include "postgresql/9.1/server/utils/resowner.h"
+#include "postgresql/9.1/server/access/xact.h"
+#include "postgresql/9.1/server/access/xlog.h"
+#include <math.h>
 #include "smile_c.h"
 
 #ifndef PG_SMILE_H
@@ -25,6 +35,85 @@ PG_MODULE_MAGIC;
 
 #define INFO_STRING "__information"
 
+/*
+ * Cut points for discretizing numeric evidence, for all nodes of one network
+ */
+struct cutpoints {
+    int numnodes;
+    int *ncuts;         // Number of cut points of each node (0 = no rule)
+    double **cuts;      // Ascending cut points of each node
+};
+
+/*
+ * The nodes of one network, as bound to columns by bindNodes
+ */
+struct netnodes {
+    char *xdsl_file;
+    int numnodes;
+    char (*names)[LEN_STRING]; // Name of each node
+    int *counts;               // Number of states of each node
+};
+
+/*
+ * The columns of a row type, indexed by name (open addressing on a hash of the name)
+ */
+struct colindex {
+    TupleDesc tupDesc;
+    int bits;                   // The table has hashsize(bits) slots
+    int *slots;                 // Column index + 1, or 0 for an empty slot
+};
+
+/*
+ * State of the smile_infer_agg aggregate: counts of the states of each evidence node over the group
+ */
+struct aggstate {
+    char *xdsl_file;
+    struct node target;
+    int numnodes;
+    struct node *evidence;      // One per node, in node id order
+    AttrNumber *attrnos;        // Column of each node (InvalidAttrNumber if none)
+    Oid *atttypids;             // Type of each node's column
+    const struct cutpoints *cp;
+    int nstates;                // Total number of states over all nodes
+    int *offsets;               // Start of each node's states in counts
+    double *counts;             // Number of rows in each state of each node
+    double *nobs;               // Number of rows with evidence for each node
+};
+
+/*
+ * An evidence signature sampled by recordProfile, with its hits since the last flush
+ */
+struct profile_entry {
+    char *xdsl_file;
+    char *target_name;
+    int numnodes;
+    int32 *signature;           // State id of each node (-1 = no evidence)
+    int64 hits;
+};
+
+// Distinct signatures held in memory before they are written to smile_evidence_profile
+#define PROFILE_BATCH 64
+// Sampled calls after which the signatures held in memory are written
+#define PROFILE_FLUSH_HITS 256
+
+// Number of steps a state distribution is quantized to in smile_infer_agg (at most MAX_UB1 - 2)
+#define AGG_LEVELS 64
+
+/*
+ * A cached result of smile_infer_agg_final, with the quantized distributions it was computed from
+ */
+struct aggcache_entry {
+    char *xdsl_file;
+    char *target_name;
+    int nstates;
+    uint8 *key;                 // Quantized distribution of each node's states
+    int count;                  // Number of target states
+    double *value;              // Probability of each target state
+};
+
+// Bits of the hash indexing the smile_infer_agg result cache
+#define AGG_CACHE_BITS 10
+
 /*
  * Standard declaration required for all PG functions, using "V1" syntax:
  * PG_FUNCTION_INFO_V1(funcname);
@@ -37,8 +126,31 @@ PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(smile_infer);
 Datum smile_infer(FunctionCallInfo fcinfo);
+PG_FUNCTION_INFO_V1(smile_infer_batch);
+Datum smile_infer_batch(FunctionCallInfo fcinfo);
+PG_FUNCTION_INFO_V1(smile_infer_scenarios);
+Datum smile_infer_scenarios(FunctionCallInfo fcinfo);
+PG_FUNCTION_INFO_V1(smile_infer_agg_trans);
+Datum smile_infer_agg_trans(FunctionCallInfo fcinfo);
+PG_FUNCTION_INFO_V1(smile_infer_agg_final);
+Datum smile_infer_agg_final(FunctionCallInfo fcinfo);
+PG_FUNCTION_INFO_V1(smile_prewarm);
+Datum smile_prewarm(FunctionCallInfo fcinfo);
+
+void _PG_init(void);
 
 char *text2cstring(text *string);
+int32 scoreValue(const double value[], const double nulvalue[], int count, int tstate);
+const struct netnodes *getNodesFor(const char *xdsl_file);
+void buildColIndex(TupleDesc tupDesc, struct colindex *ci);
+int findColumn(const struct colindex *ci, const char *name);
+int bindNodes(const char *xdsl_file, struct node *target, struct node evidence[], const struct colindex *ci, int attidx[]);
+void flushProfile(void);
+void recordProfile(const char *xdsl_file, const char *target_name, struct node evidence[], int numnodes);
+int prewarmCache(const char *xdsl_file, const char *target_name, int count);
+const struct cutpoints *getCutPointsFor(const char *xdsl_file);
+bool numericDatum(Datum value, Oid typid, double *out, bool *integral);
+int discretize(const struct cutpoints *cp, const struct node *n, double value, bool integral);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1665 @@
+/*
+ * @file smile_native.cpp
+ * @details An in-tree exact inference engine behind the smile_c.h API
+ *
+ * Compiled in place of smile_c.cpp when SMILE_NATIVE is defined, so the
+ * extension can be built without the prebuilt SMILE library. Networks are read
+ * from .xdsl files (cpt and deterministic nodes) and queried by variable
+ * elimination over contiguous potentials.
+ */
+
+#ifdef SMILE_NATIVE
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <math.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "smile_native.h"
+#include "smile_c.h"
+#include "../include/bj_hash.h"
+
+using namespace std;
+
+namespace smile_native {
+
+/*###################################
+#
+# Vector kernels
+#
+###################################*/
+
+/*
+ * @brief out[i] = a[i] * b[i]
+ */
+static inline void vec_mul(double *__restrict out, const double *__restrict a, const double *__restrict b, size_t n) {
+    size_t i = 0;
+#if defined(__AVX__)
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+/*
+ * @brief out[i] = a[i] * s
+ */
+static inline void vec_scale(double *__restrict out, const double *__restrict a, double s, size_t n) {
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256d vs = _mm256_set1_pd(s);
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vs));
+    }
+#elif defined(__SSE2__)
+    __m128d vs = _mm_set1_pd(s);
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), vs));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = a[i] * s;
+    }
+}
+
+/*
+ * @brief out[i] += a[i]
+ */
+static inline void vec_add(double *__restrict out, const double *__restrict a, size_t n) {
+    size_t i = 0;
+#if defined(__AVX__)
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(out + i), _mm256_loadu_pd(a + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(out + i), _mm_loadu_pd(a + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] += a[i];
+    }
+}
+
+/*
+ * @brief Sum of a[0..n-1]
+ */
+static inline double vec_sum(const double *a, size_t n) {
+    double s = 0.0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        s += a[i];
+    }
+    return s;
+}
+
+/*###################################
+#
+# Factor operations
+#
+###################################*/
+
+/*
+ * @brief Works out the nodes of a product and the strides of the operands
+ *
+ * @param a First factor
+ * @param b Second factor
+ * @param out Receives the nodes and cardinalities of the product (data untouched)
+ * @param ina, inb Set for each output dimension to whether a or b has that node
+ * @param sa, sb Set to the stride of each output dimension in a or b (zero if absent)
+ * @return Number of entries of the product
+ *
+ */
+static size_t product_shape(const Factor &a, const Factor &b, Factor &out,
+        vector<char> &ina, vector<char> &inb, vector<size_t> &sa, vector<size_t> &sb) {
+    size_t i, j, nd, total, s_a, s_b;
+    int k;
+
+    out.vars.clear();
+    out.card.clear();
+    ina.clear();
+    inb.clear();
+    i = j = 0;
+    while (i < a.vars.size() || j < b.vars.size()) {
+        if (j == b.vars.size() || (i < a.vars.size() && a.vars[i] < b.vars[j])) {
+            out.vars.push_back(a.vars[i]);
+            out.card.push_back(a.card[i]);
+            ina.push_back(1);
+            inb.push_back(0);
+            i++;
+        } else if (i == a.vars.size() || b.vars[j] < a.vars[i]) {
+            out.vars.push_back(b.vars[j]);
+            out.card.push_back(b.card[j]);
+            ina.push_back(0);
+            inb.push_back(1);
+            j++;
+        } else {
+            out.vars.push_back(a.vars[i]);
+            out.card.push_back(a.card[i]);
+            ina.push_back(1);
+            inb.push_back(1);
+            i++;
+            j++;
+        }
+    }
+    nd = out.vars.size();
+
+    sa.assign(nd, 0);
+    sb.assign(nd, 0);
+    s_a = s_b = 1;
+    for (k = (int) nd - 1; k >= 0; k--) {
+        if (ina[k]) {
+            sa[k] = s_a;
+            s_a *= out.card[k];
+        }
+        if (inb[k]) {
+            sb[k] = s_b;
+            s_b *= out.card[k];
+        }
+    }
+
+    total = 1;
+    for (i = 0; i < nd; i++) {
+        total *= out.card[i];
+    }
+    return total;
+}
+
+/*
+ * @brief Multiplies two factors
+ *
+ * @param a First factor
+ * @param b Second factor
+ * @param out Product over the union of the nodes of a and b (must not alias a or b)
+ * @details The trailing output dimensions that belong to the same operand(s)
+ *   are contiguous in those operands, so they are processed as a single run.
+ *
+ */
+void factor_product(const Factor &a, const Factor &b, Factor &out) {
+    size_t i, nd, total, run, o, ia, ib;
+    int k, tail;
+    vector<char> ina, inb;
+    vector<size_t> sa, sb;
+    vector<int> ctr;
+
+    total = product_shape(a, b, out, ina, inb, sa, sb);
+    nd = out.vars.size();
+    if (nd == 0) {
+        out.data.assign(1, a.data[0] * b.data[0]);
+        return;
+    }
+    out.data.resize(total);
+
+    tail = (int) nd - 1;
+    while (tail > 0 && ina[tail - 1] == ina[nd - 1] && inb[tail - 1] == inb[nd - 1]) {
+        tail--;
+    }
+    run = 1;
+    for (i = tail; i < nd; i++) {
+        run *= out.card[i];
+    }
+
+    ctr.assign(tail, 0);
+    ia = ib = 0;
+    for (o = 0; o < total; o += run) {
+        if (ina[nd - 1] && inb[nd - 1]) {
+            vec_mul(&out.data[o], &a.data[ia], &b.data[ib], run);
+        } else if (ina[nd - 1]) {
+            vec_scale(&out.data[o], &a.data[ia], b.data[ib], run);
+        } else {
+            vec_scale(&out.data[o], &b.data[ib], a.data[ia], run);
+        }
+        for (k = tail - 1; k >= 0; k--) {
+            if (++ctr[k] < out.card[k]) {
+                ia += sa[k];
+                ib += sb[k];
+                break;
+            }
+            ia -= sa[k] * (out.card[k] - 1);
+            ib -= sb[k] * (out.card[k] - 1);
+            ctr[k] = 0;
+        }
+    }
+}
+
+/*
+ * @brief Locates a node in a factor and splits the table around it
+ *
+ * @return Position of var in a.vars, or -1 if absent
+ */
+static int factor_split(const Factor &a, int var, size_t *outer, size_t *inner) {
+    int p, k;
+
+    for (p = 0; p < (int) a.vars.size(); p++) {
+        if (a.vars[p] == var) break;
+    }
+    if (p == (int) a.vars.size()) {
+        return -1;
+    }
+    *outer = *inner = 1;
+    for (k = 0; k < p; k++) {
+        *outer *= a.card[k];
+    }
+    for (k = p + 1; k < (int) a.vars.size(); k++) {
+        *inner *= a.card[k];
+    }
+    return p;
+}
+
+/*
+ * @brief Sums a node out of a factor
+ *
+ * @param a The factor
+ * @param var Node id to marginalize
+ * @param out Marginal (must not alias a)
+ *
+ */
+void factor_sum_out(const Factor &a, int var, Factor &out) {
+    size_t outer, inner, o, cv, k;
+    int p;
+    const double *src;
+    double *dst;
+
+    p = factor_split(a, var, &outer, &inner);
+    if (p < 0) {
+        out = a;
+        return;
+    }
+    cv = a.card[p];
+    out.vars = a.vars;
+    out.card = a.card;
+    out.vars.erase(out.vars.begin() + p);
+    out.card.erase(out.card.begin() + p);
+    out.data.resize(outer * inner);
+
+    for (o = 0; o < outer; o++) {
+        src = &a.data[o * cv * inner];
+        dst = &out.data[o * inner];
+        if (inner == 1) {
+            *dst = vec_sum(src, cv);
+        } else {
+            memcpy(dst, src, inner * sizeof(double));
+            for (k = 1; k < cv; k++) {
+                vec_add(dst, src + k * inner, inner);
+            }
+        }
+    }
+}
+
+/*
+ * @brief Restricts a factor to one state of a node (sets evidence)
+ *
+ * @param a The factor
+ * @param var Node id
+ * @param state State index of var
+ * @param out Reduced factor (must not alias a)
+ *
+ */
+void factor_reduce(const Factor &a, int var, int state, Factor &out) {
+    size_t outer, inner, o, cv;
+    int p;
+
+    p = factor_split(a, var, &outer, &inner);
+    if (p < 0) {
+        out = a;
+        return;
+    }
+    cv = a.card[p];
+    out.vars = a.vars;
+    out.card = a.card;
+    out.vars.erase(out.vars.begin() + p);
+    out.card.erase(out.card.begin() + p);
+    out.data.resize(outer * inner);
+
+    for (o = 0; o < outer; o++) {
+        memcpy(&out.data[o * inner], &a.data[(o * cv + state) * inner], inner * sizeof(double));
+    }
+}
+
+/*###################################
+#
+# XDSL reader
+#
+###################################*/
+
+const char *XmlElem::attr(const char *key) const {
+    size_t i;
+
+    for (i = 0; i < attrs.size(); i++) {
+        if (attrs[i].first == key) return attrs[i].second.c_str();
+    }
+    return NULL;
+}
+
+const XmlElem *XmlElem::child(const char *key) const {
+    size_t i;
+
+    for (i = 0; i < children.size(); i++) {
+        if (children[i].name == key) return &children[i];
+    }
+    return NULL;
+}
+
+static void xml_decode(const char *s, size_t len, string &out) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (s[i] != '&') {
+            out += s[i];
+        } else if (!strncmp(s + i, "&amp;", 5)) {
+            out += '&'; i += 4;
+        } else if (!strncmp(s + i, "&lt;", 4)) {
+            out += '<'; i += 3;
+        } else if (!strncmp(s + i, "&gt;", 4)) {
+            out += '>'; i += 3;
+        } else if (!strncmp(s + i, "&quot;", 6)) {
+            out += '"'; i += 5;
+        } else if (!strncmp(s + i, "&apos;", 6)) {
+            out += '\''; i += 5;
+        } else {
+            out += s[i];
+        }
+    }
+}
+
+static int is_name_char(char c) {
+    return c && !isspace((unsigned char) c) && c != '>' && c != '/' && c != '=';
+}
+
+/*
+ * @brief Skips the XML declaration, comments and doctype ahead of an element
+ */
+static void xml_skip_misc(const char *&p) {
+    const char *e;
+
+    for (;;) {
+        while (isspace((unsigned char) *p)) p++;
+        if (!strncmp(p, "<?", 2)) {
+            e = strstr(p, "?>");
+            p = e ? e + 2 : p + strlen(p);
+        } else if (!strncmp(p, "<!--", 4)) {
+            e = strstr(p, "-->");
+            p = e ? e + 3 : p + strlen(p);
+        } else if (!strncmp(p, "<!", 2)) {
+            e = strchr(p, '>');
+            p = e ? e + 1 : p + strlen(p);
+        } else {
+            return;
+        }
+    }
+}
+
+/*
+ * @brief Parses one element (and its children) starting at '<'
+ *
+ * @return 0 on success, -1 on malformed input
+ */
+static int xml_parse(const char *&p, XmlElem &elem) {
+    const char *s, *e;
+    char q;
+    string key, close;
+
+    if (*p != '<') return -1;
+    p++;
+    s = p;
+    while (is_name_char(*p)) p++;
+    elem.name.assign(s, p - s);
+
+    // Attributes
+    for (;;) {
+        while (isspace((unsigned char) *p)) p++;
+        if (!strncmp(p, "/>", 2)) {
+            p += 2;
+            return 0;
+        }
+        if (*p == '>') {
+            p++;
+            break;
+        }
+        s = p;
+        while (is_name_char(*p)) p++;
+        if (p == s) return -1;
+        key.assign(s, p - s);
+        while (isspace((unsigned char) *p)) p++;
+        if (*p++ != '=') return -1;
+        while (isspace((unsigned char) *p)) p++;
+        q = *p++;
+        if (q != '"' && q != '\'') return -1;
+        e = strchr(p, q);
+        if (!e) return -1;
+        elem.attrs.push_back(make_pair(key, string()));
+        xml_decode(p, e - p, elem.attrs.back().second);
+        p = e + 1;
+    }
+
+    // Content
+    for (;;) {
+        s = p;
+        while (*p && *p != '<') p++;
+        xml_decode(s, p - s, elem.text);
+        if (!*p) return -1;
+        if (!strncmp(p, "</", 2)) {
+            p += 2;
+            s = p;
+            while (is_name_char(*p)) p++;
+            close.assign(s, p - s);
+            if (close != elem.name) return -1;
+            e = strchr(p, '>');
+            if (!e) return -1;
+            p = e + 1;
+            return 0;
+        } else if (!strncmp(p, "<!--", 4)) {
+            e = strstr(p, "-->");
+            if (!e) return -1;
+            p = e + 3;
+        } else if (!strncmp(p, "<![CDATA[", 9)) {
+            e = strstr(p, "]]>");
+            if (!e) return -1;
+            elem.text.append(p + 9, e - p - 9);
+            p = e + 3;
+        } else {
+            elem.children.push_back(XmlElem());
+            if (xml_parse(p, elem.children.back()) < 0) return -1;
+        }
+    }
+}
+
+int Network::FindNode(const char *id) const {
+    size_t i;
+
+    for (i = 0; i < nodes.size(); i++) {
+        if (nodes[i].id == id) return (int) i;
+    }
+    return -1;
+}
+
+/*
+ * @brief Adds a cpt or deterministic node from its XDSL element
+ *
+ * @return Node id, or -1 if the node type is unsupported or malformed
+ * @details The XDSL table lists parents in declaration order with the node's own
+ *   states varying fastest; it is transposed here to the ascending-id layout.
+ *
+ */
+int Network::AddNode(const XmlElem &elem) {
+    Node node;
+    const XmlElem *x;
+    const char *id;
+    vector<double> probs;
+    vector<size_t> src_stride;
+    vector<int> order, ctr;
+    size_t i, j, nconf, total, si;
+    int self, k, nd;
+    string tok;
+
+    if (elem.name != "cpt" && elem.name != "deterministic") {
+        return -1;
+    }
+    if (!(id = elem.attr("id")) || FindNode(id) >= 0) {
+        return -1;
+    }
+    node.id = id;
+    self = (int) nodes.size();
+
+    for (i = 0; i < elem.children.size(); i++) {
+        x = &elem.children[i];
+        if (x->name == "state" && x->attr("id")) {
+            node.states.push_back(x->attr("id"));
+        } else if (x->name == "property" && x->attr("id")) {
+            node.properties.push_back(make_pair(string(x->attr("id")), x->text));
+        }
+    }
+    if (node.states.empty()) {
+        return -1;
+    }
+
+    if ((x = elem.child("parents"))) {
+        istringstream ss(x->text);
+        while (ss >> tok) {
+            if ((k = FindNode(tok.c_str())) < 0) return -1;
+            node.parents.push_back(k);
+        }
+    }
+    nconf = 1;
+    for (i = 0; i < node.parents.size(); i++) {
+        nconf *= nodes[node.parents[i]].states.size();
+    }
+    total = nconf * node.states.size();
+
+    if (elem.name == "cpt") {
+        if (!(x = elem.child("probabilities"))) return -1;
+        const char *p = x->text.c_str();
+        char *end;
+        for (;;) {
+            double v = strtod(p, &end);
+            if (end == p) break;
+            probs.push_back(v);
+            p = end;
+        }
+    } else {
+        if (!(x = elem.child("resultingstates"))) return -1;
+        istringstream ss(x->text);
+        while (ss >> tok) {
+            for (j = 0; j < node.states.size(); j++) {
+                if (node.states[j] == tok) break;
+            }
+            if (j == node.states.size()) return -1;
+            for (k = 0; k < (int) node.states.size(); k++) {
+                probs.push_back(k == (int) j ? 1.0 : 0.0);
+            }
+        }
+    }
+    if (probs.size() != total) {
+        return -1;
+    }
+
+    // Source order is (parents..., self); target order is ascending node id
+    order = node.parents;
+    order.push_back(self);
+    nd = (int) order.size();
+    src_stride.assign(nd, 1);
+    for (k = nd - 2; k >= 0; k--) {
+        src_stride[k] = src_stride[k + 1] * (k + 1 == nd - 1 ? node.states.size() : nodes[order[k + 1]].states.size());
+    }
+    vector<pair<int, size_t> > sorted;
+    for (k = 0; k < nd; k++) {
+        sorted.push_back(make_pair(order[k], src_stride[k]));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    for (k = 0; k < nd; k++) {
+        node.cpt.vars.push_back(sorted[k].first);
+        node.cpt.card.push_back(sorted[k].first == self ? (int) node.states.size() : (int) nodes[sorted[k].first].states.size());
+    }
+    for (k = 1; k < nd; k++) {
+        if (node.cpt.vars[k] == node.cpt.vars[k - 1]) return -1;
+    }
+    node.cpt.data.resize(total);
+    ctr.assign(nd, 0);
+    si = 0;
+    for (i = 0; i < total; i++) {
+        node.cpt.data[i] = probs[si];
+        for (k = nd - 1; k >= 0; k--) {
+            if (++ctr[k] < node.cpt.card[k]) {
+                si += sorted[k].second;
+                break;
+            }
+            si -= sorted[k].second * (node.cpt.card[k] - 1);
+            ctr[k] = 0;
+        }
+    }
+
+    nodes.push_back(node);
+    return self;
+}
+
+/*
+ * @brief Reads an .xdsl file
+ *
+ * @param fname Filename of an .xdsl file
+ * @return 0 on success, negative on error
+ *
+ */
+int Network::ReadFile(const char *fname) {
+    ifstream in(fname, ios::in | ios::binary);
+    ostringstream buf;
+    string doc;
+    XmlElem root;
+    const XmlElem *xnodes;
+    const char *p;
+    size_t i;
+
+    if (!in) {
+        return -1;
+    }
+    buf << in.rdbuf();
+    doc = buf.str();
+    p = doc.c_str();
+    xml_skip_misc(p);
+    if (xml_parse(p, root) < 0 || root.name != "smile") {
+        return -1;
+    }
+    if (!(xnodes = root.child("nodes"))) {
+        return -1;
+    }
+    nodes.clear();
+    for (i = 0; i < xnodes->children.size(); i++) {
+        if (AddNode(xnodes->children[i]) < 0) {
+            nodes.clear();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*###################################
+#
+# Inference
+#
+###################################*/
+
+/*
+ * @brief Marks the ancestors of a set of nodes (including the nodes themselves)
+ *
+ * @param net The network
+ * @param roots Node ids to start from
+ * @param relevant Set to nonzero for each ancestor, indexed by node id
+ *
+ */
+static void mark_ancestors(const Network &net, vector<int> roots, vector<char> &relevant) {
+    size_t j;
+    int v;
+
+    relevant.assign(net.GetNumberOfNodes(), 0);
+    while (!roots.empty()) {
+        v = roots.back();
+        roots.pop_back();
+        if (relevant[v]) continue;
+        relevant[v] = 1;
+        for (j = 0; j < net.GetNode(v).parents.size(); j++) {
+            roots.push_back(net.GetNode(v).parents[j]);
+        }
+    }
+}
+
+/*
+ * @brief Picks the next node to eliminate: the one whose combined potential is smallest
+ *
+ * @param hidden Node ids still to be eliminated
+ * @param factors The current potentials
+ * @param mark Scratch array of zeros, indexed by node id (left as zeros)
+ * @return Position in hidden of the chosen node
+ *
+ */
+static int pick_elimination(const vector<int> &hidden, const vector<const Factor *> &factors, vector<char> &mark) {
+    int i, best;
+    size_t j, k;
+    double w, best_w;
+
+    best = 0;
+    best_w = -1.0;
+    for (i = 0; i < (int) hidden.size(); i++) {
+        w = 1.0;
+        for (j = 0; j < factors.size(); j++) {
+            if (!binary_search(factors[j]->vars.begin(), factors[j]->vars.end(), hidden[i])) continue;
+            for (k = 0; k < factors[j]->vars.size(); k++) {
+                if (!mark[factors[j]->vars[k]]) {
+                    mark[factors[j]->vars[k]] = 1;
+                    w *= factors[j]->card[k];
+                }
+            }
+        }
+        for (j = 0; j < factors.size(); j++) {
+            for (k = 0; k < factors[j]->vars.size(); k++) {
+                mark[factors[j]->vars[k]] = 0;
+            }
+        }
+        if (best_w < 0.0 || w < best_w) {
+            best_w = w;
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*
+ * @brief Computes the posterior distribution of one node by variable elimination
+ *
+ * @param target Node id of the target
+ * @param stateids Array of size GetNumberOfNodes() with the observed state of each node, or -1; can be zero
+ * @param val Pointer to an array with one entry per state of target
+ * @return status
+ * @details Only ancestors of the target and of observed nodes are relevant; the
+ *   rest are barren and are dropped before elimination. Hidden nodes are
+ *   eliminated greedily, smallest resulting potential first.
+ *
+ */
+int Network::Posterior(int target, const int stateids[], double val[]) const {
+    int n = (int) nodes.size();
+    int count, i, v, best;
+    size_t j;
+    double tot;
+    vector<char> relevant, mark(n, 0);
+    vector<int> roots, hidden;
+    vector<Factor> factors, rest;
+    vector<const Factor *> fptrs;
+    Factor f, g;
+
+    count = (int) nodes[target].states.size();
+    if (stateids && stateids[target] >= 0) {
+        // Observed target: an indicator, but only if the evidence is possible
+        vector<int> others(stateids, stateids + n);
+        others[target] = -1;
+        if ((i = Posterior(target, &others[0], val)) != SMILE_OK) {
+            return i;
+        }
+        if (!(val[stateids[target]] > 0.0)) {
+            return SMILE_INVALID_VALUE;
+        }
+        for (i = 0; i < count; i++) {
+            val[i] = (i == stateids[target]) ? 1.0 : 0.0;
+        }
+        return SMILE_OK;
+    }
+
+    roots.push_back(target);
+    for (i = 0; stateids && i < n; i++) {
+        if (stateids[i] >= 0) roots.push_back(i);
+    }
+    mark_ancestors(*this, roots, relevant);
+
+    for (i = 0; i < n; i++) {
+        if (!relevant[i]) continue;
+        f = nodes[i].cpt;
+        for (j = 0; stateids && j < nodes[i].cpt.vars.size(); j++) {
+            v = nodes[i].cpt.vars[j];
+            if (stateids[v] >= 0) {
+                factor_reduce(f, v, stateids[v], g);
+                f.vars.swap(g.vars);
+                f.card.swap(g.card);
+                f.data.swap(g.data);
+            }
+        }
+        factors.push_back(f);
+        if (i != target && !(stateids && stateids[i] >= 0)) {
+            hidden.push_back(i);
+        }
+    }
+
+    while (!hidden.empty()) {
+        fptrs.clear();
+        for (j = 0; j < factors.size(); j++) {
+            fptrs.push_back(&factors[j]);
+        }
+        best = pick_elimination(hidden, fptrs, mark);
+        v = hidden[best];
+        hidden.erase(hidden.begin() + best);
+
+        rest.clear();
+        f = Factor();
+        f.data.assign(1, 1.0);
+        for (j = 0; j < factors.size(); j++) {
+            if (binary_search(factors[j].vars.begin(), factors[j].vars.end(), v)) {
+                factor_product(f, factors[j], g);
+                f.vars.swap(g.vars);
+                f.card.swap(g.card);
+                f.data.swap(g.data);
+            } else {
+                rest.push_back(factors[j]);
+            }
+        }
+        factor_sum_out(f, v, g);
+        rest.push_back(g);
+        factors.swap(rest);
+    }
+
+    f = Factor();
+    f.data.assign(1, 1.0);
+    for (j = 0; j < factors.size(); j++) {
+        factor_product(f, factors[j], g);
+        f.vars.swap(g.vars);
+        f.card.swap(g.card);
+        f.data.swap(g.data);
+    }
+    if (f.vars.size() != 1 || f.vars[0] != target) {
+        return SMILE_INVALID_VALUE;
+    }
+
+    tot = vec_sum(&f.data[0], f.size());
+    if (!(tot > 0.0)) {
+        // Evidence has zero probability
+        return SMILE_INVALID_VALUE;
+    }
+    for (i = 0; i < count; i++) {
+        val[i] = f.data[i] / tot;
+    }
+    return SMILE_OK;
+}
+
+/*###################################
+#
+# Compiled queries
+#
+###################################*/
+
+/*
+ * @brief A potential during query compilation
+ * @details Constant potentials carry their values in f.data; lane potentials
+ *   depend on the evidence and live in register reg.
+ */
+struct QuerySym {
+    Factor f;
+    int reg;
+    int lanes;
+};
+
+int Query::AddConst(const Factor &f) {
+    QueryReg r;
+
+    r.size = f.size();
+    r.lanes = 0;
+    r.offset = 0;
+    r.data = f.data;
+    regs.push_back(r);
+    return (int) regs.size() - 1;
+}
+
+int Query::AddLane(size_t size) {
+    QueryReg r;
+
+    r.size = size;
+    r.lanes = 1;
+    r.offset = lane_size;
+    lane_size += size;
+    regs.push_back(r);
+    return (int) regs.size() - 1;
+}
+
+/*
+ * @brief Compiles the posterior of a target given a set of observed nodes
+ *
+ * @param net The network
+ * @param target Node id of the target
+ * @param observed Node ids of the observed nodes, ascending and unique
+ * @return 0 on success, -1 on error
+ * @details Runs variable elimination symbolically: every observed node is
+ *   eliminated too, after multiplying in its likelihood vector, and each product
+ *   or marginal that touches a likelihood becomes one step of the program.
+ *
+ */
+int Query::Compile(const Network &net, int target, const vector<int> &observed) {
+    int n = net.GetNumberOfNodes();
+    int i, v, best;
+    size_t j, e, total, nd;
+    vector<char> relevant, mark(n, 0), ina, inb;
+    vector<size_t> sa, sb;
+    vector<int> roots, hidden, ctr;
+    vector<QuerySym> syms, rest, group;
+    vector<const Factor *> fptrs;
+    QuerySym x, y, z;
+    QueryOp op;
+
+    this->target = target;
+    this->observed = observed;
+    count = (int) net.GetNode(target).states.size();
+    regs.clear();
+    ops.clear();
+    lambda_off.clear();
+    lambda_reg.clear();
+    lambda_size = lane_size = 0;
+
+    roots = observed;
+    roots.push_back(target);
+    mark_ancestors(net, roots, relevant);
+
+    for (i = 0; i < n; i++) {
+        if (!relevant[i]) continue;
+        x.f = net.GetNode(i).cpt;
+        x.reg = -1;
+        x.lanes = 0;
+        syms.push_back(x);
+        if (i != target) hidden.push_back(i);
+    }
+    for (j = 0; j < observed.size(); j++) {
+        x.f = Factor();
+        x.f.vars.push_back(observed[j]);
+        x.f.card.push_back((int) net.GetNode(observed[j]).states.size());
+        x.reg = AddLane(x.f.card[0]);
+        x.lanes = 1;
+        lambda_reg.push_back(x.reg);
+        lambda_off.push_back(lambda_size);
+        lambda_size += x.f.card[0];
+        syms.push_back(x);
+    }
+
+    for (;;) {
+        rest.clear();
+        group.clear();
+        if (hidden.empty()) {
+            // Combine whatever is left into the potential over the target
+            group.swap(syms);
+            v = -1;
+        } else {
+            fptrs.clear();
+            for (j = 0; j < syms.size(); j++) {
+                fptrs.push_back(&syms[j].f);
+            }
+            best = pick_elimination(hidden, fptrs, mark);
+            v = hidden[best];
+            hidden.erase(hidden.begin() + best);
+            for (j = 0; j < syms.size(); j++) {
+                if (binary_search(syms[j].f.vars.begin(), syms[j].f.vars.end(), v)) {
+                    group.push_back(syms[j]);
+                } else {
+                    rest.push_back(syms[j]);
+                }
+            }
+        }
+
+        // Fold the constant potentials first, then multiply in the lane potentials
+        x.f = Factor();
+        x.f.data.assign(1, 1.0);
+        x.reg = -1;
+        x.lanes = 0;
+        for (j = 0; j < group.size(); j++) {
+            if (group[j].lanes) continue;
+            factor_product(x.f, group[j].f, z.f);
+            x.f.vars.swap(z.f.vars);
+            x.f.card.swap(z.f.card);
+            x.f.data.swap(z.f.data);
+        }
+        for (j = 0; j < group.size(); j++) {
+            if (!group[j].lanes) continue;
+            y = group[j];
+            if (!x.lanes && x.f.size() == 1 && x.f.vars.empty() && x.f.data[0] == 1.0) {
+                x = y;
+                continue;
+            }
+            total = product_shape(x.f, y.f, z.f, ina, inb, sa, sb);
+            nd = z.f.vars.size();
+            op = QueryOp();
+            op.product = 1;
+            op.a = x.lanes ? x.reg : AddConst(x.f);
+            op.b = y.reg;
+            op.dst = AddLane(total);
+            op.ia.resize(total);
+            op.ib.resize(total);
+            ctr.assign(nd, 0);
+            size_t ia = 0, ib = 0;
+            for (e = 0; e < total; e++) {
+                op.ia[e] = (int) ia;
+                op.ib[e] = (int) ib;
+                for (int k = (int) nd - 1; k >= 0; k--) {
+                    if (++ctr[k] < z.f.card[k]) {
+                        ia += sa[k];
+                        ib += sb[k];
+                        break;
+                    }
+                    ia -= sa[k] * (z.f.card[k] - 1);
+                    ib -= sb[k] * (z.f.card[k] - 1);
+                    ctr[k] = 0;
+                }
+            }
+            ops.push_back(op);
+            x.f.vars = z.f.vars;
+            x.f.card = z.f.card;
+            x.f.data.clear();
+            x.reg = op.dst;
+            x.lanes = 1;
+        }
+
+        if (v < 0) break;
+
+        if (!x.lanes) {
+            factor_sum_out(x.f, v, z.f);
+            x.f.vars.swap(z.f.vars);
+            x.f.card.swap(z.f.card);
+            x.f.data.swap(z.f.data);
+        } else {
+            op = QueryOp();
+            op.product = 0;
+            op.a = x.reg;
+            op.b = -1;
+            best = factor_split(x.f, v, &op.outer, &op.inner);
+            op.cv = x.f.card[best];
+            op.dst = AddLane(op.outer * op.inner);
+            ops.push_back(op);
+            x.f.vars.erase(x.f.vars.begin() + best);
+            x.f.card.erase(x.f.card.begin() + best);
+            x.reg = op.dst;
+        }
+        rest.push_back(x);
+        syms.swap(rest);
+    }
+
+    if (x.f.vars.size() != 1 || x.f.vars[0] != target) {
+        return -1;
+    }
+    result = x.lanes ? x.reg : AddConst(x.f);
+    return 0;
+}
+
+/*
+ * @brief Evaluates a compiled query for many rows of evidence
+ *
+ * @param lambda Array of nrows * LambdaSize() likelihoods: for each row, one entry
+ *   per state of each observed node, in the order of Observed()
+ * @param nrows Number of rows
+ * @param val Pointer to an array of size nrows * (number of target states); rows
+ *   with impossible evidence are set to NaN
+ * @return status
+ * @details Rows are processed QUERY_LANES at a time, with the rows of a chunk
+ *   interleaved in each register so every step is a vector operation over lanes.
+ *   The scratch area holds one chunk, so a single row needs lane_size doubles.
+ *
+ */
+int Query::Evaluate(const double *lambda, int nrows, double *val) const {
+    // Kept per thread and only ever grown; every lane register is written before it is read
+    static thread_local vector<double> scratch;
+    size_t need = lane_size * (nrows < QUERY_LANES ? nrows : QUERY_LANES);
+    int retval = SMILE_OK;
+    int start, L, l, s;
+    size_t j, e, o, k, inner;
+    double *dst, tot;
+    const double *pa, *pb, *src;
+
+    if (scratch.size() < need) {
+        scratch.resize(need);
+    }
+    for (start = 0; start < nrows; start += QUERY_LANES) {
+        L = nrows - start < QUERY_LANES ? nrows - start : QUERY_LANES;
+
+        // Load likelihoods, transposed so rows are the fastest dimension
+        for (j = 0; j < lambda_reg.size(); j++) {
+            const QueryReg &r = regs[lambda_reg[j]];
+            dst = &scratch[r.offset * L];
+            for (e = 0; e < r.size; e++) {
+                for (l = 0; l < L; l++) {
+                    dst[e * L + l] = lambda[(size_t) (start + l) * lambda_size + lambda_off[j] + e];
+                }
+            }
+        }
+
+        for (j = 0; j < ops.size(); j++) {
+            const QueryOp &op = ops[j];
+            const QueryReg &ra = regs[op.a];
+            dst = &scratch[regs[op.dst].offset * L];
+            pa = ra.lanes ? &scratch[ra.offset * L] : &ra.data[0];
+            if (op.product) {
+                pb = &scratch[regs[op.b].offset * L];
+                if (ra.lanes) {
+                    for (e = 0; e < op.ia.size(); e++) {
+                        vec_mul(dst + e * L, pa + op.ia[e] * L, pb + op.ib[e] * L, L);
+                    }
+                } else {
+                    for (e = 0; e < op.ia.size(); e++) {
+                        vec_scale(dst + e * L, pb + op.ib[e] * L, pa[op.ia[e]], L);
+                    }
+                }
+            } else {
+                inner = op.inner * L;
+                for (o = 0; o < op.outer; o++) {
+                    src = pa + o * op.cv * inner;
+                    memcpy(dst + o * inner, src, inner * sizeof(double));
+                    for (k = 1; k < op.cv; k++) {
+                        vec_add(dst + o * inner, src + k * inner, inner);
+                    }
+                }
+            }
+        }
+
+        // Normalize each row
+        const QueryReg &rr = regs[result];
+        for (l = 0; l < L; l++) {
+            double *row = val + (size_t) (start + l) * count;
+            for (s = 0; s < count; s++) {
+                row[s] = rr.lanes ? scratch[(rr.offset + s) * L + l] : rr.data[s];
+            }
+            tot = vec_sum(row, count);
+            if (tot > 0.0) {
+                for (s = 0; s < count; s++) {
+                    row[s] /= tot;
+                }
+            } else {
+                // Evidence has zero probability
+                for (s = 0; s < count; s++) {
+                    row[s] = NAN;
+                }
+                retval = SMILE_INVALID_VALUE;
+            }
+        }
+    }
+    return retval;
+}
+
+/*
+ * @brief Finds or compiles the query for a target and a set of observed nodes
+ *
+ * @param target Node id of the target
+ * @param observed Node ids of the observed nodes, ascending and unique
+ * @return The compiled query, or null if it could not be compiled or too many are cached
+ * @details Safe to call from several threads: callers wait while a new query is compiled
+ *
+ */
+const Query *Network::Compile(int target, const vector<int> &observed) const {
+    map<vector<int>, Query>::iterator it;
+    vector<int> key;
+    Query q;
+
+    key.push_back(target);
+    key.insert(key.end(), observed.begin(), observed.end());
+    // Entries are never removed, so the pointer returned stays valid after the lock is released
+    lock_guard<mutex> guard(queries_lock);
+    it = queries.find(key);
+    if (it != queries.end()) {
+        return &it->second;
+    }
+    if (queries.size() >= MAX_QUERIES || q.Compile(*this, target, observed) < 0) {
+        return NULL;
+    }
+    return &(queries[key] = q);
+}
+
+} // namespace smile_native
+
+/*###################################
+#
+# smile_c.h API
+#
+###################################*/
+
+using smile_native::Network;
+using smile_native::Query;
+
+struct net {
+    Network *ptr;
+    int id;
+};
+
+/*
+ * @brief Keeps track of a hash of networks, indexed by the filename
+ *
+ * @param fname Filename of an .xdsl file
+ * @return Pointer to the network
+ * @note This has no prototype in the header file because of the C/C++ mix required
+ *
+ */
+struct net getNetwork(const char *fname) {
+    static struct net nets[hashsize(10)];
+    static int curr_id = 0;
+    int h;
+
+    // Use the filename as an index into a hash table so only load once
+    h = ::hash((ub1*) fname, (ub4) strlen(fname), (ub4) 0);
+    h = (h & hashmask(10));
+
+    // Create the network, if not already created
+    if (nets[h].ptr == NULL) {
+        nets[h].ptr = new Network();
+        if (nets[h].ptr->ReadFile(fname) < 0) {
+            // Error reading in file
+            delete nets[h].ptr;
+            nets[h].ptr = NULL;
+        }
+        nets[h].id = curr_id++;
+    }
+
+    return nets[h];
+}
+
+int checkFileName(const char *fname) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    } else {
+        return SMILE_OK;
+    }
+}
+
+int getNumNodes(const char *fname) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return -1;
+    }
+
+    return (net_info.ptr)->GetNumberOfNodes();
+}
+
+int getNodeNameLen(const char *fname, int id) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return 0;
+    }
+
+    return (net_info.ptr)->GetNode(id).id.size();
+}
+
+char* copyNodeName(const char *fname, int id, char name[]) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return 0;
+    }
+
+    return strcpy(name, (net_info.ptr)->GetNode(id).id.c_str());
+}
+
+int getNumOutcomes(const char *fname, int id) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return -1;
+    }
+
+    return (net_info.ptr)->GetNode(id).states.size();
+}
+
+int getStateId(const char *fname, int id, const char *state) {
+    struct net net_info;
+    int i, numoutcomes;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return -1;
+    }
+
+    const vector<string> &outcomes = (net_info.ptr)->GetNode(id).states;
+    numoutcomes = outcomes.size();
+
+    for (i = 0; i < numoutcomes; i++) {
+        if (outcomes[i] == state) {
+            break;
+        }
+    }
+    return i;
+}
+
+char* copyStateName(const char *fname, int id, int stateid, char name[]) {
+    struct net net_info;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return 0;
+    }
+
+    const vector<string> &outcomes = (net_info.ptr)->GetNode(id).states;
+    if (stateid < 0 || stateid >= (int) outcomes.size()) {
+        return 0;
+    }
+
+    return strcpy(name, outcomes[stateid].c_str());
+}
+
+/*
+ * @brief Reads the cut points used to discretize numeric evidence for a node
+ *
+ * @param fname Filename of an .xdsl file
+ * @param id Node id
+ * @param cuts Array to hold up to maxcuts cut points
+ * @param maxcuts Size of the cuts array
+ * @return Number of cut points (0 if the node has no CUTS_PROPERTY property), or -1 on error
+ *
+ */
+int getCutPoints(const char *fname, int id, double cuts[], int maxcuts) {
+    struct net net_info;
+    const char *p;
+    char *end;
+    size_t i;
+    int n;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return -1;
+    }
+
+    const vector<pair<string, string> > &props = (net_info.ptr)->GetNode(id).properties;
+    for (i = 0; i < props.size(); i++) {
+        if (props[i].first == CUTS_PROPERTY) break;
+    }
+    if (i == props.size()) {
+        return 0;
+    }
+
+    p = props[i].second.c_str();
+    for (n = 0; n < maxcuts; n++) {
+        cuts[n] = strtod(p, &end);
+        if (end == p) break;
+        p = end;
+    }
+    return n;
+}
+
+void free_node(struct node n) {
+    // The name and state are held in the struct itself
+}
+
+void free_nodes(struct node *n, int N) {
+    int i;
+
+    for (i = 0; i < N; i++) {
+        free_node(n[i]);
+    }
+
+    pfree(n);
+}
+
+/*
+ * @brief Looks up the ids of the target and evidence nodes where they are not already set
+ *
+ * @param net The network
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param evidence An array of node structs with node names and/or ids set; can be zero
+ * @param nevidence Size of the evidence array
+ * @return status
+ * @details A nonpositive id signals that it's undefined. The ids are written back,
+ *   so on repeated calls these are defined.
+ *
+ */
+static int resolveNodes(const Network *net, struct node *target, struct node evidence[], int nevidence) {
+    int all_ok;
+    int i;
+
+    if (target->id <= 0) {
+        target->id = net->FindNode(target->name);
+        if (target->id < 0) {
+            return SMILE_BAD_TARGET_NAME;
+        }
+    }
+    if ((int) net->GetNode(target->id).states.size() != target->count) {
+        return SMILE_TARGET_SIZE_DIFF_FROM_COUNT;
+    }
+
+    // Even if a problem, loop over all and return to user
+    all_ok = 1;
+    for (i = 0; evidence && i < nevidence; i++) {
+        if (evidence[i].id <= 0) {
+            evidence[i].id = net->FindNode(evidence[i].name);
+            if (evidence[i].id < 0) {
+                all_ok = 0;
+            }
+        }
+    }
+    return all_ok ? SMILE_OK : SMILE_BAD_EVIDENCE_NAME;
+}
+
+/*
+ * @brief A cached getProb result, with the key it was computed for
+ */
+struct prob_entry {
+    vector<ub1> key;    // Network id, target id and evidence state ids (see getProb)
+    vector<double> val; // Probability of each target state
+};
+
+/*
+ * @brief Carries out Bayesian inference for a row of values
+ *
+ * @param fname Filename of an .xdsl file
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param val Pointer to an array of size target.count to hold target probabilities (undef if error)
+ * @param evidence An array of node structs with node names and/or ids set, and evidence names set or zero (null pointer); can be zero
+ *    Where the evidence name is zero, the state id is used (-1 for no evidence)
+ * @param nevidence Size of the evidence array
+ * @return status
+ *
+ */
+int getProb(const char *fname, struct node *target, double val[], struct node evidence[], int nevidence) {
+    Network *net;
+    struct net net_info;
+    int numnodes, numoutcomes;
+    int i, j;
+    int retval;
+    // Hash table for storing results
+    int h;
+    int tot_len;
+    static struct prob_entry *prob_hash[hashsize(16)];
+    struct prob_entry *e;
+    // Assume that there are fewer than 255 possible values for each evidence node (use one negative value, -1 = 255)
+    // Also add EVIDENCE_OFFSET entries for the ids of the network and target
+    ub1 evidence_key[MAX_NODES + EVIDENCE_OFFSET] = {0};
+    vector<int> stateids, observed;
+    vector<double> lambda;
+    const Query *query;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    }
+    net = net_info.ptr;
+
+    // First, put the network id at the start of the hash key
+    evidence_key[0] = (ub1) (net_info.id & 0xff);
+    evidence_key[1] = (ub1) (net_info.id >> 8);
+    tot_len = EVIDENCE_OFFSET + nevidence;
+
+    numnodes = net->GetNumberOfNodes();
+    stateids.assign(numnodes, -1);
+
+    // Get the ids of the target and evidence nodes if not already defined
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
+    }
+    // Then the target id, so each target of a network has its own entries
+    evidence_key[2] = (ub1) (target->id & 0xff);
+    evidence_key[3] = (ub1) (target->id >> 8);
+
+    // Set evidence, if set
+    if (evidence) {
+        for (i = 0; i < nevidence; i++) {
+            const vector<string> &outcomes = net->GetNode(evidence[i].id).states;
+            numoutcomes = outcomes.size();
+            // Take the string state as definitive: if null, then use the state id as set
+            // by the caller (e.g. from a discretized numeric value), where -1 = no evidence set
+            if (!evidence[i].state[0]) {
+                if (evidence[i].stateid >= numoutcomes) {
+                    evidence[i].stateid = -1;
+                }
+            } else {
+                for (j = 0; j < numoutcomes; j++) {
+                    if (outcomes[j] == evidence[i].state) {
+                        evidence[i].stateid = j;
+                        break;
+                    }
+                }
+            }
+            // Calculate the key into the hash table -- values for evidence nodes -- add after filename
+            evidence_key[i + EVIDENCE_OFFSET] = (ub1) evidence[i].stateid;
+        }
+
+        for (i = 0; i < nevidence; i++) {
+            if (evidence[i].stateid >= 0) {
+                stateids[evidence[i].id] = evidence[i].stateid;
+            }
+        }
+    } else {
+        // If evidence is null then no evidence set, and want these all to be -1 (or 255)
+        for (i = 0; i < nevidence; i++) {
+            evidence_key[i + EVIDENCE_OFFSET] = (ub1) -1;
+        }
+    }
+
+    // Have we already stored this? If yes, return immediately.
+    h = ::hash((ub1 *) evidence_key, (ub4) tot_len, (ub4) 0);
+    h = (h & hashmask(16));
+    e = prob_hash[h];
+    // Each slot keeps its key, so a different key that hashes to the same slot is computed and replaces it
+    if (e && (int) e->val.size() == target->count && e->key.size() == (size_t) tot_len
+            && !memcmp(&e->key[0], evidence_key, tot_len)) {
+        for (i = 0; i < target->count; i++) {
+            val[i] = e->val[i];
+        }
+        return SMILE_OK;
+    }
+
+    // Calculate network, through the compiled query for this set of observed nodes if possible
+    for (i = 0; i < numnodes; i++) {
+        if (stateids[i] >= 0) observed.push_back(i);
+    }
+    query = net->Compile(target->id, observed);
+    if (query) {
+        lambda.assign(query->LambdaSize(), 0.0);
+        for (i = 0; i < (int) observed.size(); i++) {
+            lambda[query->LambdaOffsets()[i] + stateids[observed[i]]] = 1.0;
+        }
+        retval = query->Evaluate(lambda.data(), 1, val);
+    } else {
+        retval = net->Posterior(target->id, &stateids[0], val);
+    }
+
+    if (retval == SMILE_OK) {
+        if (!e) {
+            e = prob_hash[h] = new prob_entry;
+        }
+        e->key.assign(evidence_key, evidence_key + tot_len);
+        e->val.assign(val, val + target->count);
+    }
+
+    return retval;
+}
+
+/*
+ * @brief Carries out Bayesian inference with likelihood (virtual) evidence
+ *
+ * @param fname Filename of an .xdsl file
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param val Pointer to an array of size target.count to hold target probabilities (undef if error)
+ * @param evidence An array of node structs with node names and/or ids set (states are ignored)
+ * @param likelihood For each evidence node, an array with a likelihood for each of its states, or zero for no evidence
+ * @param nevidence Size of the evidence and likelihood arrays
+ * @return status
+ *
+ */
+int getProbLikelihood(const char *fname, struct node *target, double val[], struct node evidence[], const double *likelihood[], int nevidence) {
+    Network *net;
+    struct net net_info;
+    int i, s, pos;
+    int retval;
+    vector<int> observed;
+    vector<double> lambda;
+    const Query *query;
+    Query uncached;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    }
+    net = net_info.ptr;
+
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
+    }
+
+    for (i = 0; i < nevidence; i++) {
+        if (likelihood[i]) observed.push_back(evidence[i].id);
+    }
+    sort(observed.begin(), observed.end());
+    observed.erase(unique(observed.begin(), observed.end()), observed.end());
+
+    query = net->Compile(target->id, observed);
+    if (!query) {
+        // Too many compiled queries: compile this one without caching it
+        if (uncached.Compile(*net, target->id, observed) < 0) {
+            return SMILE_INVALID_VALUE;
+        }
+        query = &uncached;
+    }
+
+    lambda.assign(query->LambdaSize(), 1.0);
+    for (i = 0; i < nevidence; i++) {
+        if (!likelihood[i]) continue;
+        pos = lower_bound(observed.begin(), observed.end(), evidence[i].id) - observed.begin();
+        for (s = 0; s < (int) net->GetNode(evidence[i].id).states.size(); s++) {
+            lambda[query->LambdaOffsets()[pos] + s] *= likelihood[i][s];
+        }
+    }
+
+    return query->Evaluate(lambda.data(), 1, val);
+}
+
+/*
+ * @brief Carries out Bayesian inference for many rows of values with the same evidence nodes
+ *
+ * @param fname Filename of an .xdsl file
+ * @param target A node struct with the name and/or id of the target node
+ *    This must have struct element target.count set to the number of outcomes
+ * @param val Pointer to an array of size nrows * target.count to hold target probabilities
+ *    (a row is NaN if its evidence is impossible)
+ * @param evidence An array of node structs with node names and/or ids set (states are ignored)
+ * @param nevidence Size of the evidence array
+ * @param stateids Array of size nrows * nevidence with the state id of each evidence node in each row, or -1 if not set
+ * @param nrows Number of rows
+ * @return status
+ * @details The query for the target and evidence nodes is compiled once and evaluated for all rows together.
+ *
+ */
+int getProbBatch(const char *fname, struct node *target, double val[], struct node evidence[], int nevidence, const int stateids[], int nrows) {
+    Network *net;
+    struct net net_info;
+    int i, j, r, s, sid;
+    int retval;
+    vector<int> observed, pos, rowids;
+    vector<double> lambda;
+    const Query *query;
+
+    net_info = getNetwork(fname);
+    if (!net_info.ptr) {
+        return SMILE_BAD_XDSL;
+    }
+    net = net_info.ptr;
+
+    if ((retval = resolveNodes(net, target, evidence, nevidence)) != SMILE_OK) {
+        return retval;
+    }
+
+    for (i = 0; i < nevidence; i++) {
+        observed.push_back(evidence[i].id);
+    }
+    sort(observed.begin(), observed.end());
+    observed.erase(unique(observed.begin(), observed.end()), observed.end());
+
+    query = net->Compile(target->id, observed);
+    if (!query) {
+        // Too many compiled queries: fall back to one elimination per row
+        retval = SMILE_OK;
+        for (r = 0; r < nrows; r++) {
+            rowids.assign(net->GetNumberOfNodes(), -1);
+            for (i = 0; i < nevidence; i++) {
+                if (stateids[(size_t) r * nevidence + i] >= 0) {
+                    rowids[evidence[i].id] = stateids[(size_t) r * nevidence + i];
+                }
+            }
+            if (net->Posterior(target->id, &rowids[0], val + (size_t) r * target->count) != SMILE_OK) {
+                for (j = 0; j < target->count; j++) {
+                    val[(size_t) r * target->count + j] = NAN;
+                }
+                retval = SMILE_INVALID_VALUE;
+            }
+        }
+        return retval;
+    }
+
+    // Likelihood of each state of each observed node: an indicator, or all ones if not set
+    for (i = 0; i < nevidence; i++) {
+        pos.push_back(lower_bound(observed.begin(), observed.end(), evidence[i].id) - observed.begin());
+    }
+    lambda.assign((size_t) nrows * query->LambdaSize(), 1.0);
+    for (r = 0; r < nrows; r++) {
+        for (i = 0; i < nevidence; i++) {
+            sid = stateids[(size_t) r * nevidence + i];
+            if (sid < 0) continue;
+            const size_t off = (size_t) r * query->LambdaSize() + query->LambdaOffsets()[pos[i]];
+            for (s = 0; s < (int) net->GetNode(evidence[i].id).states.size(); s++) {
+                if (s != sid) lambda[off + s] = 0.0;
+            }
+        }
+    }
+
+    return query->Evaluate(lambda.data(), nrows, val);
+}
+
+#endif /* SMILE_NATIVE */
@@ -0,0 +1,136 @@
+/**
+ * @file smile_native.h
+ * @details An in-tree exact inference engine for XDSL networks, used in place
+ *   of the SMILE library when built with SMILE_NATIVE defined
+ *
+ * Potentials are stored as contiguous row-major tables over node ids sorted in
+ * ascending order, so the last (highest id) node varies fastest. Because every
+ * factor uses the same ordering, the trailing dimensions of a product or a
+ * marginal always map onto contiguous runs, and the inner loops reduce to the
+ * vector kernels in smile_native.cpp.
+ */
+
+#ifndef SMILE_NATIVE_H
+#define	SMILE_NATIVE_H
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Number of evidence rows evaluated together by a compiled query
+#define QUERY_LANES 16
+// Maximum number of compiled queries kept per network
+#define MAX_QUERIES 256
+
+namespace smile_native {
+
+/*
+ * @brief A potential over a set of discrete nodes
+ */
+struct Factor {
+    std::vector<int> vars;      // Node ids, ascending
+    std::vector<int> card;      // Number of states of each node in vars
+    std::vector<double> data;   // Row-major, last node fastest
+
+    size_t size() const { return data.size(); }
+};
+
+void factor_product(const Factor &a, const Factor &b, Factor &out);
+void factor_sum_out(const Factor &a, int var, Factor &out);
+void factor_reduce(const Factor &a, int var, int state, Factor &out);
+
+/*
+ * @brief A minimal XML element tree, enough to read .xdsl files
+ */
+struct XmlElem {
+    std::string name;
+    std::vector<std::pair<std::string, std::string> > attrs;
+    std::string text;
+    std::vector<XmlElem> children;
+
+    const char *attr(const char *key) const;
+    const XmlElem *child(const char *key) const;
+};
+
+struct Node {
+    std::string id;
+    std::vector<std::string> states;
+    std::vector<int> parents;
+    std::vector<std::pair<std::string, std::string> > properties;
+    Factor cpt;                 // P(node | parents), over parents + node
+};
+
+class Network;
+
+/*
+ * @brief One step of a compiled query
+ */
+struct QueryOp {
+    int product;                // Nonzero: dst = a * b; zero: dst = a with one node summed out
+    int dst, a, b;              // Register indices
+    std::vector<int> ia, ib;    // Product: entry of a and b for each entry of dst
+    size_t outer, cv, inner;    // Sum out: a is viewed as [outer][cv][inner]
+};
+
+/*
+ * @brief A register of a compiled query
+ * @details Constant registers hold one value per entry in data; lane registers
+ *   hold QUERY_LANES (or fewer) rows per entry in the scratch area, at offset.
+ */
+struct QueryReg {
+    size_t size;
+    int lanes;
+    size_t offset;
+    std::vector<double> data;
+};
+
+/*
+ * @brief The posterior of one target given a fixed set of observed nodes, compiled
+ *   into a flat arithmetic circuit
+ * @details Each observed node enters as a likelihood vector (one entry per state;
+ *   an indicator for hard evidence, all ones for missing evidence), so the same
+ *   circuit serves every row. Products of CPTs alone are folded at compile time.
+ */
+class Query {
+public:
+    int Compile(const Network &net, int target, const std::vector<int> &observed);
+    int Evaluate(const double *lambda, int nrows, double *val) const;
+    size_t LambdaSize() const { return lambda_size; }
+    const std::vector<int> &Observed() const { return observed; }
+    const std::vector<size_t> &LambdaOffsets() const { return lambda_off; }
+
+private:
+    int AddConst(const Factor &f);
+    int AddLane(size_t size);
+
+    int target, count, result;
+    std::vector<int> observed;
+    std::vector<size_t> lambda_off;
+    std::vector<int> lambda_reg;
+    size_t lambda_size, lane_size;
+    std::vector<QueryReg> regs;
+    std::vector<QueryOp> ops;
+};
+
+class Network {
+public:
+    int ReadFile(const char *fname);
+    int GetNumberOfNodes() const { return (int) nodes.size(); }
+    int FindNode(const char *id) const;
+    const Node &GetNode(int id) const { return nodes[id]; }
+    int Posterior(int target, const int stateids[], double val[]) const;
+    const Query *Compile(int target, const std::vector<int> &observed) const;
+
+private:
+    int AddNode(const XmlElem &elem);
+    std::vector<Node> nodes;
+    // Compiled queries are shared by all threads; Compile holds the lock while it looks up or adds one
+    mutable std::mutex queries_lock;
+    mutable std::map<std::vector<int>, Query> queries;
+};
+
+} // namespace smile_native
+
+#endif	/* SMILE_NATIVE_H */
@@ -0,0 +1,552 @@
+/*
+ * @file smile_score.cpp
+ * @details Command-line bulk scoring of evidence files through the smile_c.h API, without PostgreSQL
+ *
+ * Usage: smile_score -x model.xdsl -t target [-k key_column] [-j threads] [-b batch_rows] [-o output] input
+ *
+ * The input is memory-mapped and is either CSV with a header row naming the columns, or a
+ * columnar binary format (detected by its magic number):
+ *    "SMLB" or "SMLC", uint32 ncols, uint64 nrows (little-endian)
+ *    ncols column names, each a uint16 length followed by the bytes; in "SMLC" each name is
+ *       followed by a uint8 width of the column's values in bytes (2, 4 or 8)
+ *    ncols columns of nrows signed integers each: int16 in "SMLB", the given width in "SMLC"
+ * Binary evidence columns hold state ids (-1 = no evidence). Columns are bound to nodes by name once; other columns are ignored. CSV fields are state
+ * names, or numbers for nodes with cut points (see CUTS_PROPERTY); empty fields are no evidence.
+ *
+ * The output has one line per row in PostgreSQL's COPY text format: the key column (or the
+ * 1-based row number without -k) followed by the probability of each target state (\N if the evidence is impossible). Rows are scored in parallel batches, and each distinct evidence signature is
+ * scored once and then served from a posterior cache.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "smile_c.h"
+
+using namespace std;
+
+#define DEFAULT_BATCH 4096
+#define MAX_CACHE 1000000
+#define BINARY_MAGIC "SMLB"
+#define TYPED_MAGIC "SMLC"
+
+/*
+ * @brief An input column and how its values map to states
+ */
+struct column {
+    string name;
+    int node;                           // Node id, or -1 if not an evidence column
+    int count;                          // Number of states of the node
+    vector<double> cuts;                // Cut points for numeric values, if any
+    unordered_map<string, int> states;  // State ids of the values seen so far
+};
+
+/*
+ * @brief A memory-mapped input file
+ */
+struct input {
+    const char *data;
+    size_t size;
+    int binary;
+    // CSV: position of the next row
+    const char *pos;
+    // Binary: start and width in bytes of each column
+    vector<const char *> colbase;
+    vector<int> width;
+    uint64_t nrows, next;
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: smile_score -x model.xdsl -t target [-k key_column] [-j threads] [-b batch_rows] [-o output] input\n");
+    exit(1);
+}
+
+static void fail(const char *msg, const char *arg) {
+    fprintf(stderr, "smile_score: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+    exit(1);
+}
+
+/*
+ * @brief Reads one CSV record
+ *
+ * @param p Position in the file; advanced past the record
+ * @param end End of the file
+ * @param fields Set to the fields of the record
+ * @return 0 at the end of the file, 1 otherwise
+ *
+ */
+static int readCsvRow(const char *&p, const char *end, vector<string> &fields) {
+    size_t n = 0;
+
+    // Skip blank lines
+    while (p < end && (*p == '\n' || *p == '\r')) p++;
+    if (p >= end) return 0;
+
+    for (;;) {
+        if (fields.size() <= n) fields.push_back(string());
+        string &f = fields[n++];
+        f.clear();
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end) {
+                if (*p == '"') {
+                    if (p + 1 < end && p[1] == '"') {
+                        f += '"';
+                        p += 2;
+                    } else {
+                        p++;
+                        break;
+                    }
+                } else {
+                    f += *p++;
+                }
+            }
+        }
+        while (p < end && *p != ',' && *p != '\n' && *p != '\r') {
+            f += *p++;
+        }
+        if (p < end && *p == ',') {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '\r') p++;
+        if (p < end && *p == '\n') p++;
+        break;
+    }
+    fields.resize(n);
+    return 1;
+}
+
+/*
+ * @brief Maps a CSV field to a state id
+ *
+ * @return State id, or -1 for no evidence (empty or unknown values)
+ *
+ */
+static int fieldStateId(const char *xdsl_file, column &col, const string &field) {
+    unordered_map<string, int>::iterator it;
+    const char *s;
+    char *end;
+    double v;
+    int sid;
+
+    if (field.empty()) {
+        return -1;
+    }
+    it = col.states.find(field);
+    if (it != col.states.end()) {
+        return it->second;
+    }
+
+    s = field.c_str();
+    v = strtod(s, &end);
+    while (*end == ' ') end++;
+    if (end != s && !*end && !col.cuts.empty()) {
+        // Number of cut points <= value
+        sid = upper_bound(col.cuts.begin(), col.cuts.end(), v) - col.cuts.begin();
+    } else {
+        sid = getStateId(xdsl_file, col.node, s);
+        if (sid >= col.count) {
+            // An integer that is not a state name is taken as the state id
+            sid = (end != s && !*end && v == (int) v && v >= 0 && v < col.count) ? (int) v : -1;
+        }
+        col.states[field] = sid;
+    }
+    return sid;
+}
+
+/*
+ * @brief Writes a field in COPY text format
+ */
+static void writeCopyField(FILE *out, const string &s) {
+    size_t i;
+
+    for (i = 0; i < s.size(); i++) {
+        switch (s[i]) {
+            case '\\': fputs("\\\\", out); break;
+            case '\t': fputs("\\t", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            default: fputc(s[i], out);
+        }
+    }
+}
+
+/*
+ * @brief Maps an input file and reads its header
+ */
+static void openInput(const char *fname, input &in, vector<column> &cols) {
+    struct stat sb;
+    vector<string> fields;
+    uint32_t ncols, i;
+    uint16_t len;
+    const char *p, *end;
+    int fd, typed;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        fail("Can't open input file", fname);
+    }
+    in.size = sb.st_size;
+    in.data = (const char *) "";
+    if (in.size > 0) {
+        in.data = (const char *) mmap(NULL, in.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in.data == MAP_FAILED) {
+            fail("Can't map input file", fname);
+        }
+        madvise((void *) in.data, in.size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    end = in.data + in.size;
+    typed = in.size >= 16 && !memcmp(in.data, TYPED_MAGIC, 4);
+    in.binary = typed || (in.size >= 16 && !memcmp(in.data, BINARY_MAGIC, 4));
+    if (in.binary) {
+        memcpy(&ncols, in.data + 4, 4);
+        memcpy(&in.nrows, in.data + 8, 8);
+        p = in.data + 16;
+        for (i = 0; i < ncols; i++) {
+            if (p + 2 > end) fail("Truncated binary header", fname);
+            memcpy(&len, p, 2);
+            p += 2;
+            if (p + len + (typed ? 1 : 0) > end) fail("Truncated binary header", fname);
+            fields.push_back(string(p, len));
+            p += len;
+            in.width.push_back(typed ? *(const uint8_t *) p++ : (int) sizeof(int16_t));
+            if (in.width[i] != 2 && in.width[i] != 4 && in.width[i] != 8) {
+                fail("Bad column width in binary header", fname);
+            }
+        }
+        for (i = 0; i < ncols; i++) {
+            if ((uint64_t) (end - p) < in.nrows * in.width[i]) {
+                fail("Truncated binary data", fname);
+            }
+            in.colbase.push_back(p);
+            p += in.nrows * in.width[i];
+        }
+        in.next = 0;
+    } else {
+        in.pos = in.data;
+        if (!readCsvRow(in.pos, end, fields)) {
+            fail("Missing CSV header", fname);
+        }
+    }
+
+    cols.resize(fields.size());
+    for (i = 0; i < fields.size(); i++) {
+        cols[i].name = fields[i];
+        cols[i].node = -1;
+        cols[i].count = 0;
+    }
+}
+
+/*
+ * @brief Reads one value of a binary column
+ *
+ * @param in The input
+ * @param c Index of the column
+ * @param row The 0-based row
+ * @return The value
+ *
+ */
+static int64_t binaryValue(const input &in, int c, uint64_t row) {
+    int16_t v2;
+    int32_t v4;
+    int64_t v8;
+    const char *p = in.colbase[c] + row * in.width[c];
+
+    switch (in.width[c]) {
+        case 2: memcpy(&v2, p, 2); return v2;
+        case 4: memcpy(&v4, p, 4); return v4;
+        default: memcpy(&v8, p, 8); return v8;
+    }
+}
+
+/*
+ * @brief Reads the next row of an input file
+ *
+ * @param in The input
+ * @param cols The columns
+ * @param keycol Index of the key column, or -1 to use the row number
+ * @param rownum The 1-based row number
+ * @param evcols Indices of the evidence columns
+ * @param xdsl_file Filename of the .xdsl file
+ * @param key Set to the key of the row
+ * @param sids Set to the state id of each evidence column
+ * @return 0 at the end of the input, 1 otherwise
+ *
+ */
+static int readRow(input &in, vector<column> &cols, int keycol, uint64_t rownum, const vector<int> &evcols,
+        const char *xdsl_file, string &key, int *sids) {
+    static vector<string> fields;
+    size_t i;
+    int64_t v;
+    int c;
+
+    if (in.binary) {
+        if (in.next >= in.nrows) return 0;
+        for (i = 0; i < evcols.size(); i++) {
+            c = evcols[i];
+            v = binaryValue(in, c, in.next);
+            sids[i] = (v >= 0 && v < cols[c].count) ? (int) v : -1;
+        }
+        if (keycol >= 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%lld", (long long) binaryValue(in, keycol, in.next));
+            key = buf;
+        }
+        in.next++;
+    } else {
+        if (!readCsvRow(in.pos, in.data + in.size, fields)) return 0;
+        for (i = 0; i < evcols.size(); i++) {
+            c = evcols[i];
+            sids[i] = (size_t) c < fields.size() ? fieldStateId(xdsl_file, cols[c], fields[c]) : -1;
+        }
+        if (keycol >= 0) {
+            key = (size_t) keycol < fields.size() ? fields[keycol] : string();
+        }
+    }
+
+    if (keycol < 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long) rownum);
+        key = buf;
+    }
+    return 1;
+}
+
+/*
+ * @brief Scores a set of distinct evidence signatures, split across threads
+ *
+ * @param xdsl_file Filename of the .xdsl file
+ * @param target The target node
+ * @param evidence The evidence nodes
+ * @param sids Array of n * evidence.size() state ids
+ * @param n Number of signatures
+ * @param nthreads Number of threads
+ * @param val Array of n * target.count probabilities (NaN rows for impossible evidence)
+ *
+ */
+static void scoreSignatures(const char *xdsl_file, const struct node &target, const vector<struct node> &evidence,
+        const int *sids, int n, int nthreads, double *val) {
+    vector<thread> workers;
+    int nev = evidence.size();
+    int chunk, t, start, len;
+
+    chunk = (n + nthreads - 1) / nthreads;
+    for (t = 0, start = 0; start < n; t++, start += chunk) {
+        len = min(chunk, n - start);
+        workers.push_back(thread([=, &target, &evidence]() {
+            // Each worker gets its own node structs, since getProbBatch fills in their ids
+            struct node tcopy = target;
+            vector<struct node> ecopy = evidence;
+            int retcode;
+
+            retcode = getProbBatch(xdsl_file, &tcopy, val + (size_t) start * target.count, ecopy.data(), nev,
+                    sids + (size_t) start * nev, len);
+            if (retcode != SMILE_OK && retcode != SMILE_INVALID_VALUE) {
+                fprintf(stderr, "smile_score: SMILE error code %d\n", retcode);
+                exit(1);
+            }
+        }));
+    }
+    for (t = 0; t < (int) workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *xdsl_file = NULL, *target_name = NULL, *key_name = NULL, *out_name = NULL;
+    int nthreads = 0, batch = DEFAULT_BATCH;
+    int opt, i, j, c, numnodes, nev, keycol, nblock, nnew, first;
+    uint64_t rownum;
+    char node_name[LEN_STRING];
+    struct node target;
+    vector<struct node> evidence;
+    vector<column> cols;
+    vector<int> evcols, sids, newsids, rowref, newref;
+    vector<string> keys;
+    vector<double> newval;
+    vector<const double *> blockval;
+    unordered_map<string, vector<double> > cache;
+    unordered_map<string, int> blockmap;
+    unordered_map<string, vector<double> >::iterator cit;
+    unordered_map<string, int>::iterator bit;
+    input in;
+    FILE *out;
+    string sig;
+
+    while ((opt = getopt(argc, argv, "x:t:k:j:b:o:")) != -1) {
+        switch (opt) {
+            case 'x': xdsl_file = optarg; break;
+            case 't': target_name = optarg; break;
+            case 'k': key_name = optarg; break;
+            case 'j': nthreads = atoi(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'o': out_name = optarg; break;
+            default: usage();
+        }
+    }
+    if (!xdsl_file || !target_name || optind != argc - 1 || batch <= 0) {
+        usage();
+    }
+    if (nthreads <= 0) {
+        nthreads = max(1, (int) thread::hardware_concurrency());
+    }
+#ifndef SMILE_NATIVE
+    // The SMILE library keeps evidence in the shared network object
+    nthreads = 1;
+#endif
+
+    if (checkFileName(xdsl_file) != SMILE_OK) {
+        fail("Can't open XDSL file", xdsl_file);
+    }
+    if (strlen(target_name) >= LEN_STRING) {
+        fail("Target node name too long", target_name);
+    }
+    strcpy(target.name, target_name);
+    target.id = -1;
+    target.state[0] = '\0';
+    target.stateid = -1;
+
+    // Bind columns to nodes once
+    openInput(argv[optind], in, cols);
+    keycol = -1;
+    numnodes = getNumNodes(xdsl_file);
+    for (c = 0; c < (int) cols.size(); c++) {
+        if (key_name && cols[c].name == key_name) {
+            keycol = c;
+        }
+    }
+    if (key_name && keycol < 0) {
+        fail("No such key column", key_name);
+    }
+    for (i = 0; i < numnodes; i++) {
+        if (getNodeNameLen(xdsl_file, i) >= LEN_STRING) {
+            fail("Node name too long", NULL);
+        }
+        copyNodeName(xdsl_file, i, node_name);
+        if (!strcmp(node_name, target_name)) {
+            target.id = i;
+            target.count = getNumOutcomes(xdsl_file, i);
+        }
+        for (c = 0; c < (int) cols.size(); c++) {
+            if (c == keycol || cols[c].name != node_name) continue;
+            struct node n;
+            double cuts[MAX_UB1];
+            strcpy(n.name, node_name);
+            n.id = i;
+            n.count = getNumOutcomes(xdsl_file, i);
+            n.state[0] = '\0';
+            n.stateid = -1;
+            evidence.push_back(n);
+            evcols.push_back(c);
+            cols[c].node = i;
+            cols[c].count = n.count;
+            j = getCutPoints(xdsl_file, i, cuts, MAX_UB1);
+            if (j > 0) cols[c].cuts.assign(cuts, cuts + j);
+            break;
+        }
+    }
+    if (target.id < 0) {
+        fail("No such target node", target_name);
+    }
+    nev = evidence.size();
+
+    out = out_name ? fopen(out_name, "w") : stdout;
+    if (!out) {
+        fail("Can't open output file", out_name);
+    }
+
+    rownum = 0;
+    first = 1;
+    for (;;) {
+        // Read a block of rows, collecting the signatures not yet cached
+        nblock = 0;
+        nnew = 0;
+        keys.resize((size_t) batch * nthreads);
+        sids.resize((size_t) batch * nthreads * nev + 1);
+        rowref.clear();
+        newref.clear();
+        newsids.clear();
+        blockval.clear();
+        blockmap.clear();
+        while (nblock < batch * nthreads &&
+                readRow(in, cols, keycol, rownum + 1, evcols, xdsl_file, keys[nblock], &sids[(size_t) nblock * nev])) {
+            sig.assign((const char *) &sids[(size_t) nblock * nev], nev * sizeof(int));
+            bit = blockmap.find(sig);
+            if (bit == blockmap.end()) {
+                bit = blockmap.insert(make_pair(sig, (int) blockval.size())).first;
+                cit = cache.find(sig);
+                if (cit != cache.end()) {
+                    blockval.push_back(&cit->second[0]);
+                } else {
+                    blockval.push_back(NULL);
+                    newref.push_back(bit->second);
+                    newsids.insert(newsids.end(), &sids[(size_t) nblock * nev], &sids[(size_t) nblock * nev] + nev);
+                    nnew++;
+                }
+            }
+            rowref.push_back(bit->second);
+            nblock++;
+            rownum++;
+        }
+        if (!nblock) break;
+
+        // Score the new signatures; the very first one runs alone so its query is compiled
+        // before the workers start, instead of them all waiting on the lock in Network::Compile
+        newval.assign((size_t) nnew * target.count + 1, 0.0);
+        if (nnew > 0) {
+            newsids.push_back(0);
+            j = 0;
+            if (first) {
+                scoreSignatures(xdsl_file, target, evidence, &newsids[0], 1, 1, &newval[0]);
+                j = 1;
+                first = 0;
+            }
+            if (nnew > j) {
+                scoreSignatures(xdsl_file, target, evidence, &newsids[(size_t) j * nev], nnew - j, nthreads,
+                        &newval[(size_t) j * target.count]);
+            }
+        }
+        for (i = 0; i < nnew; i++) {
+            blockval[newref[i]] = &newval[(size_t) i * target.count];
+            if (cache.size() < MAX_CACHE) {
+                sig.assign((const char *) &newsids[(size_t) i * nev], nev * sizeof(int));
+                cache[sig].assign(&newval[(size_t) i * target.count], &newval[(size_t) (i + 1) * target.count]);
+            }
+        }
+
+        // Stream the results in input order
+        for (i = 0; i < nblock; i++) {
+            const double *v = blockval[rowref[i]];
+            writeCopyField(out, keys[i]);
+            for (j = 0; j < target.count; j++) {
+                if (v[j] != v[j]) {
+                    fputs("\t\\N", out);
+                } else {
+                    fprintf(out, "\t%.10g", v[j]);
+                }
+            }
+            fputc('\n', out);
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (in.size > 0) {
+        munmap((void *) in.data, in.size);
+    }
+    return 0;
+}
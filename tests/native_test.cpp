@@ -0,0 +1,321 @@
+/*
+ * @file native_test.cpp
+ * @details Checks the native engine against brute-force enumeration
+ *
+ * Reads tests/fixture.xdsl (or the file named on the command line) and compares
+ * Posterior, compiled queries, getProb, getProbBatch and getProbLikelihood with
+ * the posterior obtained by summing the joint distribution over every
+ * configuration, including evidence with zero probability.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <math.h>
+#include "../src/smile_native.h"
+#include "../src/smile_c.h"
+
+using namespace std;
+using smile_native::Network;
+using smile_native::Query;
+
+#define NUM_NODES 6
+#define MAX_STATES 3
+#define NUM_TRIALS 2000
+#define BATCH_ROWS 37
+#define TOL 1e-12
+
+/*###################################
+#
+# The fixture, in XDSL order (declared parents, then the node's own state fastest)
+#
+###################################*/
+
+static const char *fx_name[NUM_NODES] = {"A", "B", "C", "D", "E", "F"};
+static const int fx_card[NUM_NODES] = {3, 2, 2, 2, 3, 2};
+static const int fx_parents[NUM_NODES][2] = {{-1, -1}, {-1, -1}, {1, 0}, {0, -1}, {3, 2}, {4, 1}};
+static const double fx_A[] = {0.2, 0.5, 0.3};
+static const double fx_B[] = {0.6, 0.4};
+static const double fx_C[] = {0.9, 0.1, 0.7, 0.3, 0.4, 0.6, 0.2, 0.8, 0.5, 0.5, 1, 0};
+static const double fx_D[] = {1, 0, 0, 1, 0, 1};
+static const double fx_E[] = {0.1, 0.6, 0.3, 0.5, 0.5, 0, 0.3, 0.3, 0.4, 0, 0.2, 0.8};
+static const double fx_F[] = {1, 0, 0.3, 0.7, 0.6, 0.4, 0.5, 0.5, 0, 1, 0.8, 0.2};
+static const double *fx_cpt[NUM_NODES] = {fx_A, fx_B, fx_C, fx_D, fx_E, fx_F};
+
+static const char *fname = "tests/fixture.xdsl";
+static int failed;
+
+/*
+ * @brief P(target | evidence) by enumeration
+ *
+ * @param target Node id of the target
+ * @param lik For each node, a likelihood for each state, or zero for no evidence
+ * @param val Pointer to an array with one entry per state of target
+ * @return 0, or -1 if the evidence has zero probability
+ *
+ */
+static int enumerate(int target, const double *lik[], double val[]) {
+    int x[NUM_NODES] = {0};
+    int n, k, idx;
+    double p, tot;
+
+    for (k = 0; k < fx_card[target]; k++) {
+        val[k] = 0.0;
+    }
+    for (;;) {
+        p = 1.0;
+        for (n = 0; n < NUM_NODES; n++) {
+            idx = 0;
+            for (k = 0; k < 2 && fx_parents[n][k] >= 0; k++) {
+                idx = idx * fx_card[fx_parents[n][k]] + x[fx_parents[n][k]];
+            }
+            p *= fx_cpt[n][idx * fx_card[n] + x[n]];
+            if (lik[n]) p *= lik[n][x[n]];
+        }
+        val[x[target]] += p;
+
+        for (n = NUM_NODES - 1; n >= 0; n--) {
+            if (++x[n] < fx_card[n]) break;
+            x[n] = 0;
+        }
+        if (n < 0) break;
+    }
+
+    tot = 0.0;
+    for (k = 0; k < fx_card[target]; k++) {
+        tot += val[k];
+    }
+    if (!(tot > 0.0)) {
+        return -1;
+    }
+    for (k = 0; k < fx_card[target]; k++) {
+        val[k] /= tot;
+    }
+    return 0;
+}
+
+/*
+ * @brief Draws hard evidence for every node (-1 for about half of them) and the
+ *   matching indicator likelihoods
+ */
+static void random_evidence(int stateids[], double ind[][MAX_STATES], const double *lik[]) {
+    int n, k;
+
+    for (n = 0; n < NUM_NODES; n++) {
+        stateids[n] = (rand() % 2) ? rand() % fx_card[n] : -1;
+        for (k = 0; k < MAX_STATES; k++) {
+            ind[n][k] = (k == stateids[n]) ? 1.0 : 0.0;
+        }
+        lik[n] = stateids[n] >= 0 ? ind[n] : 0;
+    }
+}
+
+/*
+ * @brief Compares a result with enumeration: both invalid, or both valid and equal
+ */
+static int check(const char *test, int trial, int target, int status, const double val[], int expected, const double want[]) {
+    int k;
+
+    if ((status == SMILE_OK) != (expected == 0)) {
+        printf("%%TEST_FAILED%% time=0 testname=%s (native_test) message=trial %d target %s: status %d, enumeration %s\n",
+                test, trial, fx_name[target], status, expected ? "impossible" : "possible");
+        failed = 1;
+        return 0;
+    }
+    for (k = 0; status == SMILE_OK && k < fx_card[target]; k++) {
+        if (!(fabs(val[k] - want[k]) < TOL)) {
+            printf("%%TEST_FAILED%% time=0 testname=%s (native_test) message=trial %d target %s state %d: %g, enumeration %g\n",
+                    test, trial, fx_name[target], k, val[k], want[k]);
+            failed = 1;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void set_node(struct node *n, int id) {
+    memset(n, 0, sizeof(*n));
+    strcpy(n->name, fx_name[id]);
+    n->id = -1;
+    n->stateid = -1;
+    n->count = fx_card[id];
+}
+
+/*###################################
+#
+# Tests
+#
+###################################*/
+
+static void test_posterior(const Network &net) {
+    int stateids[NUM_NODES];
+    double ind[NUM_NODES][MAX_STATES], val[MAX_STATES], want[MAX_STATES];
+    const double *lik[NUM_NODES];
+    int trial, target, expected, status;
+
+    for (trial = 0; trial < NUM_TRIALS; trial++) {
+        random_evidence(stateids, ind, lik);
+        target = rand() % NUM_NODES;
+        expected = enumerate(target, lik, want);
+        status = net.Posterior(target, stateids, val);
+        if (!check("test_posterior", trial, target, status, val, expected, want)) return;
+    }
+}
+
+static void test_query(const Network &net) {
+    int stateids[NUM_NODES];
+    double ind[NUM_NODES][MAX_STATES], val[MAX_STATES], want[MAX_STATES];
+    const double *lik[NUM_NODES];
+    vector<int> observed;
+    vector<double> lambda;
+    Query query;
+    int trial, target, expected, status, n;
+    size_t j;
+
+    for (trial = 0; trial < NUM_TRIALS; trial++) {
+        random_evidence(stateids, ind, lik);
+        target = rand() % NUM_NODES;
+        expected = enumerate(target, lik, want);
+        observed.clear();
+        for (n = 0; n < NUM_NODES; n++) {
+            if (stateids[n] >= 0) observed.push_back(n);
+        }
+        // Compiled here rather than through the network, which caches only MAX_QUERIES
+        if (query.Compile(net, target, observed) < 0) {
+            printf("%%TEST_FAILED%% time=0 testname=test_query (native_test) message=trial %d: not compiled\n", trial);
+            failed = 1;
+            return;
+        }
+        lambda.assign(query.LambdaSize(), 0.0);
+        for (j = 0; j < observed.size(); j++) {
+            lambda[query.LambdaOffsets()[j] + stateids[observed[j]]] = 1.0;
+        }
+        status = query.Evaluate(lambda.data(), 1, val);
+        if (!check("test_query", trial, target, status, val, expected, want)) return;
+    }
+}
+
+static void test_getprob(void) {
+    struct node target, evidence[NUM_NODES];
+    int stateids[NUM_NODES];
+    double ind[NUM_NODES][MAX_STATES], val[MAX_STATES], want[MAX_STATES];
+    const double *lik[NUM_NODES];
+    int trial, expected, status, n, t;
+
+    for (n = 0; n < NUM_NODES; n++) {
+        set_node(&evidence[n], n);
+        lik[n] = 0;
+    }
+    // The prior of every target, as smile_infer asks for it: each target has its own cache entry
+    for (t = 0; t < NUM_NODES; t++) {
+        set_node(&target, t);
+        expected = enumerate(t, lik, want);
+        status = getProb(fname, &target, val, 0, NUM_NODES);
+        if (!check("test_getprob", -1, t, status, val, expected, want)) return;
+    }
+    // Targets take turns, so they share evidence signatures
+    for (trial = 0; trial < NUM_TRIALS; trial++) {
+        t = trial % NUM_NODES;
+        set_node(&target, t);
+        random_evidence(stateids, ind, lik);
+        expected = enumerate(t, lik, want);
+        for (n = 0; n < NUM_NODES; n++) {
+            // Alternate between state names and state ids
+            evidence[n].state[0] = '\0';
+            evidence[n].stateid = stateids[n];
+            if (stateids[n] >= 0 && trial / NUM_NODES % 2) {
+                copyStateName(fname, n, stateids[n], evidence[n].state);
+            }
+        }
+        status = getProb(fname, &target, val, evidence, NUM_NODES);
+        if (!check("test_getprob", trial, t, status, val, expected, want)) return;
+    }
+}
+
+static void test_batch(void) {
+    struct node target, evidence[NUM_NODES];
+    int stateids[BATCH_ROWS][NUM_NODES];
+    double ind[BATCH_ROWS][NUM_NODES][MAX_STATES], val[BATCH_ROWS * MAX_STATES], want[MAX_STATES];
+    const double *lik[BATCH_ROWS][NUM_NODES];
+    int trial, r, t, expected, status;
+
+    for (t = 0; t < NUM_NODES; t++) {
+        set_node(&evidence[t], t);
+    }
+    for (trial = 0; trial < NUM_TRIALS / BATCH_ROWS; trial++) {
+        set_node(&target, trial % NUM_NODES);
+        for (r = 0; r < BATCH_ROWS; r++) {
+            random_evidence(stateids[r], ind[r], lik[r]);
+        }
+        getProbBatch(fname, &target, val, evidence, NUM_NODES, &stateids[0][0], BATCH_ROWS);
+        for (r = 0; r < BATCH_ROWS; r++) {
+            // Rows of val are target.count wide
+            expected = enumerate(target.id, lik[r], want);
+            status = isnan(val[r * target.count]) ? SMILE_INVALID_VALUE : SMILE_OK;
+            if (!check("test_batch", trial * BATCH_ROWS + r, target.id, status, val + r * target.count, expected, want)) return;
+        }
+    }
+}
+
+static void test_likelihood(void) {
+    struct node target, evidence[NUM_NODES];
+    double liks[NUM_NODES][MAX_STATES], val[MAX_STATES], want[MAX_STATES];
+    const double *lik[NUM_NODES];
+    int trial, t, n, k, expected, status;
+
+    for (trial = 0; trial < NUM_TRIALS; trial++) {
+        t = rand() % NUM_NODES;
+        set_node(&target, t);
+        for (n = 0; n < NUM_NODES; n++) {
+            set_node(&evidence[n], n);
+            for (k = 0; k < fx_card[n]; k++) {
+                // Some zeros, so that some evidence is impossible
+                liks[n][k] = (rand() % 4) ? (double) rand() / RAND_MAX : 0.0;
+            }
+            lik[n] = (rand() % 2) ? liks[n] : 0;
+        }
+        expected = enumerate(t, lik, want);
+        status = getProbLikelihood(fname, &target, val, evidence, lik, NUM_NODES);
+        if (!check("test_likelihood", trial, t, status, val, expected, want)) return;
+    }
+}
+
+static void test_cutpoints(void) {
+    double cuts[4];
+
+    if (getCutPoints(fname, 0, cuts, 4) != 2 || cuts[0] != 10.0 || cuts[1] != 20.0 || getCutPoints(fname, 1, cuts, 4) != 0) {
+        printf("%%TEST_FAILED%% time=0 testname=test_cutpoints (native_test) message=wrong cut points\n");
+        failed = 1;
+    }
+}
+
+#define RUN(test, args) \
+    printf("%%TEST_STARTED%% " #test " (native_test)\n"); \
+    test args; \
+    printf("%%TEST_FINISHED%% time=0 " #test " (native_test)\n")
+
+int main(int argc, char** argv) {
+    Network net;
+
+    if (argc > 1) {
+        fname = argv[1];
+    }
+    printf("%%SUITE_STARTING%% native_test\n");
+    printf("%%SUITE_STARTED%%\n");
+    if (net.ReadFile(fname) < 0 || net.GetNumberOfNodes() != NUM_NODES || checkFileName(fname) != SMILE_OK) {
+        printf("%%TEST_FAILED%% time=0 testname=read (native_test) message=cannot read %s\n", fname);
+        return EXIT_FAILURE;
+    }
+    srand(1);
+
+    RUN(test_posterior, (net));
+    RUN(test_query, (net));
+    RUN(test_getprob, ());
+    RUN(test_batch, ());
+    RUN(test_likelihood, ());
+    RUN(test_cutpoints, ());
+
+    printf("%%SUITE_FINISHED%% time=0\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Checks the smile_score tool on CSV and binary input against tests/score_expected.tsv
+#
+# Usage: tests/score_test.sh path/to/smile_score [work_dir]
+#
+# The binary inputs are written here byte by byte, so the test needs no generator program.
+
+SCORE=$1
+WORK=${2:-.}
+DIR=$(dirname "$0")
+XDSL=$DIR/fixture.xdsl
+
+# Writes VALUE as a little-endian integer of BYTES bytes
+le() {
+    v=$2
+    if [ "$v" -lt 0 ]; then
+        v=$((v + (1 << ($1 * 8 - 1)) * 2))
+    fi
+    i=0
+    while [ $i -lt "$1" ]; do
+        printf "\\$(printf %03o $((v & 255)))"
+        v=$((v >> 8))
+        i=$((i + 1))
+    done
+}
+
+# Writes a column name with its length
+name() {
+    le 2 ${#1}
+    printf %s "$1"
+}
+
+cat > "$WORK/score.csv" <<'CSV'
+district,A,B,C,extra
+d1,5,b0,,x
+d2,a1,,c1,
+d3,25,b1,c1,
+"d,4",,,,
+d5,1,,,
+CSV
+
+# Typed columns: a 4-byte key with values outside int16, and 2- and 8-byte state ids
+{
+    printf SMLC; le 4 3; le 8 3
+    name id; le 1 4
+    name A; le 1 2
+    name C; le 1 8
+    le 4 100000; le 4 -70000; le 4 7
+    le 2 0; le 2 2; le 2 -1
+    le 8 -1; le 8 1; le 8 0
+} > "$WORK/score_typed.bin"
+
+# Untyped columns: all int16
+{
+    printf SMLB; le 4 2; le 8 2
+    name id
+    name B
+    le 2 1; le 2 -2
+    le 2 0; le 2 -1
+} > "$WORK/score.bin"
+
+echo "%SUITE_STARTING% score_test"
+echo "%SUITE_STARTED%"
+{
+    echo "# csv -k district"
+    "$SCORE" -x "$XDSL" -t F -k district -j 2 -b 2 "$WORK/score.csv"
+    echo "# csv"
+    "$SCORE" -x "$XDSL" -t F "$WORK/score.csv"
+    echo "# SMLC -k id"
+    "$SCORE" -x "$XDSL" -t F -k id "$WORK/score_typed.bin"
+    echo "# SMLB -k id"
+    "$SCORE" -x "$XDSL" -t F -k id "$WORK/score.bin"
+    echo "# SMLB"
+    "$SCORE" -x "$XDSL" -t F "$WORK/score.bin"
+} > "$WORK/score_actual.tsv" 2>&1
+
+echo "%TEST_STARTED% test_output (score_test)"
+if diff "$DIR/score_expected.tsv" "$WORK/score_actual.tsv"; then
+    echo "%TEST_FINISHED% time=0 test_output (score_test)"
+    echo "%SUITE_FINISHED% time=0"
+else
+    echo "%TEST_FAILED% time=0 testname=test_output (score_test) message=output differs from tests/score_expected.tsv"
+    echo "%SUITE_FINISHED% time=0"
+    exit 1
+fi